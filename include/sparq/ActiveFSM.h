@@ -6,11 +6,14 @@
 #define SPARQ_ACTIVEFSM_H
 
 #include "FSM.h"
-#include "SafeQ.h"
+#include "DefaultQ.h"
 #include "TimeQ.h"
 #include "PODVariant.h"
+#include "Thread.h"
+#include <atomic>
 #include <type_traits>
-#include <thread>
+#include <utility>
+#include <vector>
 
 #ifdef SPARQ_DEBUG
 #include <syslog.h>
@@ -123,17 +126,35 @@ namespace sparq {
 
     // This FSM is very lightweight, but it has singleton semantics.  That seems suboptimal
     // from a testing/infrastructure perspective.
-    template<class F, class EventType>
+    //
+    // The input queue defaults to a SafeQ (a BoundedQ with SPARQ_REALTIME, see DefaultQ.h), but
+    // any type with the SafeQ interface can be used
+    // instead: a RingQ for many producers, or a LaneQ to give some events priority over others.
+    // (An SPSCQ only fits an FSM with no timers and no self posts, see SPSCQ.h.)
+    // Likewise the timers default to a TimeQ, and a TimerWheel can be used for FSMs that
+    // keep a lot of timers outstanding.
+    // The clock of the timers is the clock of the FSM: with BasicTimeQ<SimClock> the FSM
+    // runs on simulated time (see SimClock.h).
+    template<class F, class EventType, class Queue = DefaultQ<EventType>, class Timers = TimeQ>
     class AFSM {
+    public:
+        typedef void (*drop_hook_t)(const EventType &event);
 
+    private:
         typedef F *state_ptr_t;
 
+        typedef ClockTraits<typename Timers::clock> clock_traits;
+
         struct AFSMInternals {
             state_ptr_t current_state;
-            SafeQ<EventType> event_Q;
-            TimeQ timers = TimeQ();
-            std::thread *t1 = nullptr;
+            Queue event_Q;
+            Timers timers = Timers();
+            typename clock_traits::Participant participant;
+            Thread *t1 = nullptr;
+            ThreadPolicy policy;
             bool quit = false;
+            std::atomic<uint64_t> selfDropped{0};
+            std::atomic<drop_hook_t> dropHook{nullptr};
         };
 
         static AFSMInternals self;
@@ -143,22 +164,80 @@ namespace sparq {
             self.quit = false;
             self.current_state = state_ptr<S>();
             self.current_state->entry();
-            self.t1 = new std::thread(&AFSM::run);
+            clock_traits::join(self.participant);
+            self.t1 = new Thread(self.policy, &AFSM::run);
         }
 
+        // Events are taken off the queue in batches of up to BatchSize, and a whole
+        // batch is handled before the timers and the quit flag are looked at again.
         static void run() {
+            onOwnThread() = true;
+            std::vector<EventType> batch;
+            batch.reserve(BatchSize);
             while (!self.quit) {
-                if (self.timers.empty()) {
-                    auto obj = self.event_Q.pop();
+                batch.clear();
+                clock_traits::wait(self.participant, self.event_Q, batch, BatchSize, self.timers);
+                for (const auto &obj : batch)
                     self.current_state->react(obj);
-                } else {
-                    EventType obj;
-                    bool msg = self.event_Q.tryPopUntil(&obj,self.timers.next());
-                    self.timers.update();
-                    if (msg)
-                        self.current_state->react(obj);
+                clock_traits::consumed(self.participant, batch.size());
+            }
+            clock_traits::leave(self.participant);
+        }
+
+        // The FSM's own thread (its handlers and its timers) must not wait for
+        // room in its own queue, as it is the only thread that makes any.  Its
+        // pushes go through the queue's tryPush, if it has one, which never
+        // waits; an event that does not fit is dropped, counted in
+        // selfDropped() and handed to the drop hook.  Other threads push as
+        // usual, and wait for room if the queue makes them.
+        static bool& onOwnThread() {
+            static thread_local bool own = false;
+            return own;
+        }
+
+        template <class U>
+        static bool pushEvent(U &&event) {
+            clock_traits::pushing(self.participant);
+            bool ok;
+            if (!onOwnThread()) {
+                ok = pushOther(self.event_Q, std::forward<U>(event), 0);
+                if (!ok) clock_traits::consumed(self.participant, 1);
+            } else {
+                ok = pushOwn(self.event_Q, std::forward<U>(event), 0);
+                if (!ok) {
+                    self.selfDropped.fetch_add(1, std::memory_order_relaxed);
+                    clock_traits::consumed(self.participant, 1);
+                    const drop_hook_t hook = self.dropHook.load(std::memory_order_acquire);
+                    if (hook) hook(event);
                 }
             }
+            clock_traits::pushed(self.participant);
+            return ok;
+        }
+
+        // A failed tryPush leaves the event alone, so the hook can see it
+        template <class Q, class U>
+        static auto pushOwn(Q &q, U &&event, int) -> decltype(static_cast<bool>(q.tryPush(std::forward<U>(event)))) {
+            return q.tryPush(std::forward<U>(event));
+        }
+
+        template <class Q, class U>
+        static bool pushOwn(Q &q, U &&event, long) {
+            q.push(std::forward<U>(event));
+            return true;
+        }
+
+        // A queue whose push says whether the event made it (a BoundedQ that
+        // does not block) passes that on
+        template <class Q, class U>
+        static auto pushOther(Q &q, U &&event, int) -> decltype(static_cast<bool>(q.push(std::forward<U>(event)))) {
+            return q.push(std::forward<U>(event));
+        }
+
+        template <class Q, class U>
+        static bool pushOther(Q &q, U &&event, long) {
+            q.push(std::forward<U>(event));
+            return true;
         }
 
     protected:
@@ -171,6 +250,7 @@ namespace sparq {
         static void signal_quit() {
             self.quit = true;
             self.event_Q.signal();
+            clock_traits::signal(self.participant);
         }
 
         template<class S>
@@ -212,10 +292,23 @@ namespace sparq {
             }
         }
 
-        timerid_t addTimer(uint64_t micros, const EventType &msg) {
-            return self.timers.add(mkTimeStamp(micros, [=]() {
-                this->push(msg);
-            }));
+        // The event may be pushed up to slackMicros late, so that the FSM can handle
+        // several timers that are due close together with a single wakeup.  The timer
+        // holds a copy of the event inline, so EventType must fit in SPARQ_CALLBACK_CAPACITY.
+        timerid_t addTimer(uint64_t micros, const EventType &msg, uint64_t slackMicros = 0) {
+            return self.timers.add(micros, [msg]() {
+                push(msg);
+            }, slackMicros);
+        }
+
+        // Pushes msg every micros until cancelled.  The deadlines stay on a fixed grid,
+        // however long the handlers take, and policy says what to do with ticks that were
+        // missed because the FSM was busy.
+        timerid_t addPeriodicTimer(uint64_t micros, const EventType &msg, MissedTicks policy = MissedTicks::Coalesce,
+                                   uint64_t slackMicros = 0) {
+            return self.timers.addPeriodic(micros, [msg]() {
+                push(msg);
+            }, policy, slackMicros);
         }
 
         bool cancelTimer(timerid_t id) {
@@ -223,17 +316,74 @@ namespace sparq {
         }
 
     public:
+        typedef AFSM afsm_type;
+
+        static const size_t BatchSize = 64;
+
         static void initialize();
 
-        static void push(const EventType &event) {
+        // Where and how the FSM's thread runs.  Call before initialize().
+        static void setThreadPolicy(const ThreadPolicy &policy) {
+            self.policy = policy;
+        }
+
+        // False if the event was dropped: pushed by the FSM's own thread to a
+        // full queue, or to a queue whose overflow policy drops.
+        static bool push(const EventType &event) {
             //std::cout << "Pushed event " << typeid(event).name() << " to " << __PRETTY_FUNCTION__ << "\n";
-            self.event_Q.push(event);
+            return pushEvent(event);
+        }
+
+        static bool push(EventType &&event) {
+            return pushEvent(std::move(event));
+        }
+
+        // Push onto a priority lane.  Needs a queue with lanes (LaneQ); the run loop
+        // always serves the highest non-empty lane first.  Since events are handled
+        // in batches, an urgent event waits for at most the rest of the current batch.
+        static void push(const EventType &event, unsigned lane) {
+            clock_traits::pushing(self.participant);
+            self.event_Q.push(event, lane);
+            clock_traits::pushed(self.participant);
+        }
+
+        static void push(EventType &&event, unsigned lane) {
+            clock_traits::pushing(self.participant);
+            self.event_Q.push(std::move(event), lane);
+            clock_traits::pushed(self.participant);
+        }
+
+        template <class ... Args>
+        static void emplace(Args&& ... args) {
+            if (onOwnThread()) {
+                pushEvent(EventType(std::forward<Args>(args)...));
+                return;
+            }
+            clock_traits::pushing(self.participant);
+            self.event_Q.emplace(std::forward<Args>(args)...);
+            clock_traits::pushed(self.participant);
         }
 
         static void join() {
             self.t1->join();
         }
 
+        // For reading queue statistics (e.g. InstrumentedQ::stats) from other threads
+        static const Queue& queue() {
+            return self.event_Q;
+        }
+
+        // Events the FSM pushed to itself that its queue had no room for
+        static uint64_t selfDropped() {
+            return self.selfDropped.load(std::memory_order_relaxed);
+        }
+
+        // Called on the FSM's own thread with each event it drops that way,
+        // e.g. a timer's event.  Null (the default) for none.
+        static void setDropHook(drop_hook_t hook) {
+            self.dropHook.store(hook, std::memory_order_release);
+        }
+
         virtual void operator()(const EventType &t) {
             std::cout << "Default handler called \n";
         }
@@ -244,13 +394,15 @@ namespace sparq {
     };
 
 
-    template<class F, class Event>
-    typename AFSM<F, Event>::AFSMInternals AFSM<F, Event>::self;
+    template<class F, class Event, class Queue, class Timers>
+    typename AFSM<F, Event, Queue, Timers>::AFSMInternals AFSM<F, Event, Queue, Timers>::self;
 
 
+// The specialization goes through afsm_type so that it also picks up the queue and
+// timer types of the FSM; _EVENT is kept for compatibility.
 #define AFSM_INITIAL_STATE(_FSM, _EVENT, _STATE) \
     namespace sparq { \
-    template<> void AFSM<_FSM, _EVENT>::initialize() { \
+    template<> void _FSM::afsm_type::initialize() { \
         enter<_STATE>(); \
       } \
     }
@@ -258,6 +410,7 @@ namespace sparq {
 
 // Syntactic sugar
 #define defineActiveFSM(name,event) struct name : public sparq::AFSM<name, event>
+#define defineActiveFSMWithQueue(name,event,...) struct name : public sparq::AFSM<name, event, __VA_ARGS__>
 #define defaultEventHandler(x) virtual void operator()(const x& event)
 #define onEvent(x) virtual void operator()(const x& event) override
 #define onEntry() virtual void entry() override
@@ -0,0 +1,279 @@
+#ifndef SPARQ_BOUNDEDQ_H
+#define SPARQ_BOUNDEDQ_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include "RealTime.h"
+
+namespace sparq {
+    // What a BoundedQ does with a push that finds it full
+    enum class Overflow {
+        Block,       // wait for the consumer to make room
+        Fail,        // reject the push (tryPush can wait for room up to a deadline)
+        DropNewest,  // discard the element being pushed
+        DropOldest   // discard the element at the head to make room
+    };
+
+    // A SafeQ with a fixed capacity, so a stalled consumer can not grow it
+    // without limit.  The storage is a ring allocated once at construction,
+    // so pushing and popping never touch the heap.  The interface is the
+    // SafeQ one, except that push returns false when the element did not
+    // make it into the queue; every such element (and every element evicted
+    // by DropOldest) is counted by dropped().
+    //
+    //     class Logger : public sparq::WorkQueue<Line, sparq::BoundedQ<Line, 4096, sparq::Overflow::DropOldest>> { ... };
+    template <class T, size_t Capacity, Overflow policy = Overflow::Block>
+    class BoundedQ {
+        static_assert(Capacity >= 1, "BoundedQ capacity must be at least 1");
+    public:
+        BoundedQ() : slots(Capacity), head(0), count(0), waitingProducers(0), drops(0) {
+            initMutex(&mutex);
+            pthread_condattr_init(&condattr);
+            pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+            pthread_cond_init(&notEmpty, &condattr);
+            pthread_cond_init(&notFull, &condattr);
+        }
+
+        bool push(const T& t) {
+            pthread_mutex_lock(&mutex);
+            const bool ok = makeRoom();
+            if (ok) put(t);
+            pthread_mutex_unlock(&mutex);
+            if (ok) pthread_cond_signal(&notEmpty);
+            return ok;
+        }
+
+        bool push(T&& t) {
+            pthread_mutex_lock(&mutex);
+            const bool ok = makeRoom();
+            if (ok) put(std::move(t));
+            pthread_mutex_unlock(&mutex);
+            if (ok) pthread_cond_signal(&notEmpty);
+            return ok;
+        }
+
+        template <class ... Args>
+        bool emplace(Args&& ... args) {
+            return push(T(std::forward<Args>(args)...));
+        }
+
+        // Never waits: false if the queue is full, whatever the overflow
+        // policy.  t is left alone then, and the push counts as dropped.
+        template <class U>
+        bool tryPush(U&& t) {
+            pthread_mutex_lock(&mutex);
+            const bool ok = count < Capacity;
+            if (ok) {
+                put(std::forward<U>(t));
+            } else {
+                drops.fetch_add(1, std::memory_order_relaxed);
+            }
+            pthread_mutex_unlock(&mutex);
+            if (ok) pthread_cond_signal(&notEmpty);
+            return ok;
+        }
+
+        // Waits until when for room, whatever the overflow policy.
+        template <class U, class S>
+        bool tryPush(U&& t, const S& when) {
+            const struct timespec ts = deadline(when);
+            pthread_mutex_lock(&mutex);
+            waitingProducers++;
+            while (count == Capacity) {
+                if (pthread_cond_timedwait(&notFull, &mutex, &ts) != 0 && count == Capacity) break;
+            }
+            waitingProducers--;
+            const bool ok = count < Capacity;
+            if (ok) {
+                put(std::forward<U>(t));
+            } else {
+                drops.fetch_add(1, std::memory_order_relaxed);
+            }
+            pthread_mutex_unlock(&mutex);
+            if (ok) pthread_cond_signal(&notEmpty);
+            return ok;
+        }
+
+        // Pushes [first, last) under a single lock, applying the overflow
+        // policy to each element, and returns how many were queued.
+        template <class It>
+        size_t pushBulk(It first, It last) {
+            size_t n = 0;
+            pthread_mutex_lock(&mutex);
+            for (; first != last; ++first) {
+                if (policy == Overflow::Block && count == Capacity) {
+                    // Let the consumer at what we have queued so far
+                    pthread_cond_broadcast(&notEmpty);
+                }
+                if (makeRoom()) {
+                    put(*first);
+                    n++;
+                }
+            }
+            pthread_mutex_unlock(&mutex);
+            if (n) pthread_cond_broadcast(&notEmpty);
+            return n;
+        }
+
+        template <class Range>
+        size_t pushBulk(const Range& r) {
+            return pushBulk(std::begin(r), std::end(r));
+        }
+
+        T pop() {
+            pthread_mutex_lock(&mutex);
+            while (count == 0) pthread_cond_wait(&notEmpty, &mutex);
+            T val = takeOne();
+            pthread_mutex_unlock(&mutex);
+            return val;
+        }
+
+        bool tryPop(T* p) {
+            pthread_mutex_lock(&mutex);
+            if (count == 0) pthread_cond_wait(&notEmpty, &mutex);
+            const bool ok = count > 0;
+            if (ok) p[0] = takeOne();
+            pthread_mutex_unlock(&mutex);
+            return ok;
+        }
+
+        template <class S>
+        bool tryPopUntil(T* p, const S& when) {
+            const struct timespec ts = deadline(when);
+            pthread_mutex_lock(&mutex);
+            if (count == 0) pthread_cond_timedwait(&notEmpty, &mutex, &ts);
+            const bool ok = count > 0;
+            if (ok) p[0] = takeOne();
+            pthread_mutex_unlock(&mutex);
+            return ok;
+        }
+
+        size_t popBatch(std::vector<T> &out, size_t max) {
+            pthread_mutex_lock(&mutex);
+            while (count == 0) pthread_cond_wait(&notEmpty, &mutex);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        size_t tryPopBatch(std::vector<T> &out, size_t max) {
+            pthread_mutex_lock(&mutex);
+            if (count == 0) pthread_cond_wait(&notEmpty, &mutex);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        template <class S>
+        size_t tryPopBatchUntil(std::vector<T> &out, size_t max, const S& when) {
+            const struct timespec ts = deadline(when);
+            pthread_mutex_lock(&mutex);
+            if (count == 0) pthread_cond_timedwait(&notEmpty, &mutex, &ts);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        size_t popAll(std::vector<T> &out) {
+            pthread_mutex_lock(&mutex);
+            const size_t n = take(out, std::numeric_limits<size_t>::max());
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        void signal() {
+            pthread_cond_signal(&notEmpty);
+        }
+
+        static constexpr size_t capacity() {
+            return Capacity;
+        }
+
+        size_t size() {
+            pthread_mutex_lock(&mutex);
+            const size_t n = count;
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        uint64_t dropped() const {
+            return drops.load(std::memory_order_relaxed);
+        }
+
+    private:
+        // The rest must be called with the mutex held
+
+        // Returns true if there is room for one more element
+        bool makeRoom() {
+            if (count < Capacity) return true;
+            switch (policy) {
+                case Overflow::Block:
+                    waitingProducers++;
+                    while (count == Capacity) pthread_cond_wait(&notFull, &mutex);
+                    waitingProducers--;
+                    return true;
+                case Overflow::DropOldest:
+                    takeOne();
+                    drops.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                case Overflow::Fail:
+                case Overflow::DropNewest:
+                    break;
+            }
+            drops.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        template <class U>
+        void put(U &&u) {
+            slots[(head + count) % Capacity] = std::forward<U>(u);
+            count++;
+        }
+
+        T takeOne() {
+            T val = std::move(slots[head]);
+            head = (head + 1) % Capacity;
+            count--;
+            if (waitingProducers) pthread_cond_signal(&notFull);
+            return val;
+        }
+
+        size_t take(std::vector<T> &out, size_t max) {
+            size_t n = 0;
+            while (n < max && count > 0) {
+                out.push_back(takeOne());
+                n++;
+            }
+            return n;
+        }
+
+        template <class S>
+        static struct timespec deadline(const S& when) {
+            const auto secs = std::chrono::time_point_cast<std::chrono::seconds>(when);
+            const auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(when - secs);
+            const struct timespec ts = {
+                static_cast<std::time_t>(secs.time_since_epoch().count()),
+                static_cast<long>(nsecs.count())
+            };
+            return ts;
+        }
+
+        std::vector<T> slots;
+        size_t head;
+        size_t count;
+        unsigned waitingProducers;
+        std::atomic<uint64_t> drops;
+        pthread_mutex_t mutex;
+        pthread_cond_t notEmpty;
+        pthread_cond_t notFull;
+        pthread_condattr_t condattr;
+    };
+}
+
+#endif //SPARQ_BOUNDEDQ_H
@@ -5,16 +5,19 @@
 #ifndef SPARQ_BROADCASTER_H
 #define SPARQ_BROADCASTER_H
 
-#include <thread>
 #include <map>
+#include <mutex>
+#include <utility>
+#include "InlineFunction.h"
+#include "Thread.h"
 
 namespace sparq {
     template <class T, class Func>
     class Broadcaster {
     public:
-        using callback = std::function<void(const T& msg)>;
-        Broadcaster() {
-            t1 = new std::thread(&Broadcaster::run, this);
+        using callback = InlineFunction<void(const T& msg)>;
+        explicit Broadcaster(const ThreadPolicy &policy = ThreadPolicy()) {
+            t1 = new Thread(policy, [this]() { run(); });
         }
 
         void join() {
@@ -29,7 +32,7 @@ namespace sparq {
 
         void subscribe(const std::string &name, callback c) {
             std::lock_guard<std::mutex> guard(lock);
-            this->listeners[name] = c;
+            this->listeners[name] = std::move(c);
         }
 
         void unsubscribe(const std::string &name) {
@@ -55,7 +58,7 @@ namespace sparq {
     private:
         std::mutex lock;
         std::map<std::string,callback> listeners;
-        std::thread *t1 = nullptr;
+        Thread *t1 = nullptr;
         bool quitflag = false;
     };
 }
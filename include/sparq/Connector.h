@@ -5,18 +5,21 @@
 #ifndef SPARQ_CONNECTOR_H
 #define SPARQ_CONNECTOR_H
 
-#include <thread>
+#include <utility>
+#include "InlineFunction.h"
+#include "Thread.h"
 
 namespace sparq {
     template<class T>
     class Connector {
     public:
-        using reader = std::function<T(void)>;
+        using reader = InlineFunction<T(void)>;
 
-        using writer = std::function<void(const T &)>;
+        using writer = InlineFunction<void(const T &)>;
 
-        Connector(const reader &r, const writer &w) :rd(r), wr(w), quitflag(false) {
-            t1 = new std::thread(&Connector::run, this);
+        Connector(reader r, writer w, const ThreadPolicy &policy = ThreadPolicy())
+                : rd(std::move(r)), wr(std::move(w)), quitflag(false) {
+            t1 = new Thread(policy, [this]() { run(); });
         }
 
         void join() {
@@ -35,7 +38,7 @@ namespace sparq {
             }
         }
 
-        std::thread *t1;
+        Thread *t1;
         reader rd;
         writer wr;
         bool quitflag;
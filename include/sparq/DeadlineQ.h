@@ -0,0 +1,276 @@
+#ifndef SPARQ_DEADLINEQ_H
+#define SPARQ_DEADLINEQ_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include "RealTime.h"
+
+namespace sparq {
+    // What a DeadlineQ does with a message whose deadline has passed by the
+    // time it is popped: hand it on anyway (it is counted as late), or drop it.
+    enum class Expired {
+        Process,
+        Drop
+    };
+
+    struct DeadlineStats {
+        uint64_t late = 0;      // popped after their deadline and handed on
+        uint64_t dropped = 0;   // popped after their deadline and dropped
+        uint64_t rejected = 0;  // pushed to a full queue (SPARQ_REALTIME only)
+    };
+
+    // A SafeQ that pops the message with the earliest deadline first
+    // (earliest deadline first scheduling), so urgent work never waits
+    // behind a backlog of bulk work:
+    //
+    //     struct Writer : sparq::WorkQueue<Record, sparq::DeadlineQ<Record, sparq::Expired::Drop>> { ... };
+    //     writer.push(record, std::chrono::steady_clock::now() + std::chrono::milliseconds(5));
+    //
+    // Messages with equal deadlines pop in the order they were pushed, and
+    // the plain SafeQ methods push with no deadline, behind everything that
+    // has one.  The messages are kept in a binary heap, so push and pop are
+    // O(log n).
+    //
+    // Deadlines are checked as messages are popped.  The batch pops take one
+    // message at a time, so that a consumer that pops in batches (WorkQueue,
+    // AFSM) still takes the earliest deadline afresh for every message, and
+    // the check happens just before the message is processed.  popAll takes
+    // everything, in deadline order.
+    //
+    // With SPARQ_REALTIME the heap has room for SPARQ_QUEUE_CAPACITY
+    // messages, made up front, and holds no more: a push to a full queue
+    // returns false and is counted as rejected.  Otherwise it grows as
+    // needed and push always returns true.
+    template <class T, Expired OnExpiry = Expired::Process>
+    class DeadlineQ {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        // Tells WorkQueue not to linger on a batch (see WorkQueue.h)
+        static const bool DeadlineOrdered = true;
+
+        DeadlineQ() : seq(0), late(0), dropped(0), rejected(0) {
+#ifdef SPARQ_REALTIME
+            heap.reserve(SPARQ_QUEUE_CAPACITY);
+#endif
+            initMutex(&mutex);
+            pthread_condattr_init(&condattr);
+            pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+            pthread_cond_init(&cond, &condattr);
+        }
+
+        ~DeadlineQ() {
+            pthread_cond_destroy(&cond);
+            pthread_condattr_destroy(&condattr);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        bool push(const T& t, clock::time_point deadline = clock::time_point::max()) {
+            pthread_mutex_lock(&mutex);
+            const bool ok = insert(T(t), deadline);
+            pthread_mutex_unlock(&mutex);
+            if (ok) pthread_cond_signal(&cond);
+            return ok;
+        }
+
+        bool push(T&& t, clock::time_point deadline = clock::time_point::max()) {
+            pthread_mutex_lock(&mutex);
+            const bool ok = insert(std::move(t), deadline);
+            pthread_mutex_unlock(&mutex);
+            if (ok) pthread_cond_signal(&cond);
+            return ok;
+        }
+
+        template <class ... Args>
+        bool emplace(Args&& ... args) {
+            return push(T(std::forward<Args>(args)...));
+        }
+
+        // Returns how many were queued
+        template <class It>
+        size_t pushBulk(It first, It last, clock::time_point deadline = clock::time_point::max()) {
+            if (first == last) return 0;
+            size_t n = 0;
+            pthread_mutex_lock(&mutex);
+            for (; first != last; ++first) {
+                if (insert(T(*first), deadline)) n++;
+            }
+            pthread_mutex_unlock(&mutex);
+            if (n) pthread_cond_broadcast(&cond);
+            return n;
+        }
+
+        template <class Range>
+        size_t pushBulk(const Range& r, clock::time_point deadline = clock::time_point::max()) {
+            return pushBulk(std::begin(r), std::end(r), deadline);
+        }
+
+        T pop() {
+            pthread_mutex_lock(&mutex);
+            for (;;) {
+                while (heap.empty()) pthread_cond_wait(&cond, &mutex);
+                if (takeOne(clock::now())) break;
+            }
+            T val = std::move(heap.back().value);
+            heap.pop_back();
+            pthread_mutex_unlock(&mutex);
+            return val;
+        }
+
+        // Like SafeQ::tryPop, it may return false early; it also does when
+        // everything it found had expired and was dropped.
+        bool tryPop(T* p) {
+            pthread_mutex_lock(&mutex);
+            if (heap.empty()) pthread_cond_wait(&cond, &mutex);
+            const bool got = takeTo(p);
+            pthread_mutex_unlock(&mutex);
+            return got;
+        }
+
+        template <class S>
+        bool tryPopUntil(T* p, const S& when) {
+            pthread_mutex_lock(&mutex);
+            if (heap.empty()) timedWait(when);
+            const bool got = takeTo(p);
+            pthread_mutex_unlock(&mutex);
+            return got;
+        }
+
+        size_t popBatch(std::vector<T> &out, size_t max) {
+            if (max == 0) return 0;
+            out.push_back(pop());
+            return 1;
+        }
+
+        size_t tryPopBatch(std::vector<T> &out, size_t max) {
+            if (max == 0) return 0;
+            pthread_mutex_lock(&mutex);
+            if (heap.empty()) pthread_cond_wait(&cond, &mutex);
+            const size_t n = take(out, 1);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        template <class S>
+        size_t tryPopBatchUntil(std::vector<T> &out, size_t max, const S& when) {
+            if (max == 0) return 0;
+            pthread_mutex_lock(&mutex);
+            if (heap.empty()) timedWait(when);
+            const size_t n = take(out, 1);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        size_t popAll(std::vector<T> &out) {
+            pthread_mutex_lock(&mutex);
+            const size_t n = take(out, std::numeric_limits<size_t>::max());
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        void signal() {
+            pthread_cond_signal(&cond);
+        }
+
+        DeadlineStats deadlineStats() const {
+            DeadlineStats s;
+            s.late = late.load(std::memory_order_relaxed);
+            s.dropped = dropped.load(std::memory_order_relaxed);
+            s.rejected = rejected.load(std::memory_order_relaxed);
+            return s;
+        }
+
+    private:
+        struct Entry {
+            clock::time_point deadline;
+            uint64_t seq;  // FIFO among equal deadlines
+            T value;
+        };
+
+        // Orders the heap so that the earliest deadline is on top
+        static bool later(const Entry &a, const Entry &b) {
+            return a.deadline != b.deadline ? a.deadline > b.deadline : a.seq > b.seq;
+        }
+
+        // The rest must be called with the mutex held
+        bool insert(T&& t, clock::time_point deadline) {
+#ifdef SPARQ_REALTIME
+            if (heap.size() == SPARQ_QUEUE_CAPACITY) {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+#endif
+            heap.push_back(Entry{deadline, seq++, std::move(t)});
+            std::push_heap(heap.begin(), heap.end(), later);
+            return true;
+        }
+
+        // Moves the earliest message to the back of the heap vector and
+        // returns true, or drops it and returns false.
+        bool takeOne(clock::time_point now) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            if (heap.back().deadline >= now) return true;
+            if (OnExpiry == Expired::Process) {
+                late.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            heap.pop_back();
+            return false;
+        }
+
+        bool takeTo(T* p) {
+            const auto now = clock::now();
+            while (!heap.empty()) {
+                if (takeOne(now)) {
+                    p[0] = std::move(heap.back().value);
+                    heap.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        size_t take(std::vector<T> &out, size_t max) {
+            const auto now = clock::now();
+            size_t n = 0;
+            while (n < max && !heap.empty()) {
+                if (takeOne(now)) {
+                    out.push_back(std::move(heap.back().value));
+                    heap.pop_back();
+                    n++;
+                }
+            }
+            return n;
+        }
+
+        template <class S>
+        void timedWait(const S& when) {
+            const auto secs = std::chrono::time_point_cast<std::chrono::seconds>(when);
+            const auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(when - secs);
+            const struct timespec ts = {
+                static_cast<std::time_t>(secs.time_since_epoch().count()),
+                static_cast<long>(nsecs.count())
+            };
+            pthread_cond_timedwait(&cond, &mutex, &ts);
+        }
+
+        std::vector<Entry> heap;
+        uint64_t seq;
+        std::atomic<uint64_t> late;
+        std::atomic<uint64_t> dropped;
+        std::atomic<uint64_t> rejected;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        pthread_condattr_t condattr;
+    };
+}
+
+#endif //SPARQ_DEADLINEQ_H
@@ -0,0 +1,21 @@
+#ifndef SPARQ_DEFAULTQ_H
+#define SPARQ_DEFAULTQ_H
+
+#include "RealTime.h"
+#include "SafeQ.h"
+#include "BoundedQ.h"
+
+namespace sparq {
+    // The queue AFSMs, WorkQueues and PubSubs use unless told otherwise: a
+    // SafeQ, or with SPARQ_REALTIME a BoundedQ that never allocates (see
+    // RealTime.h).
+#ifdef SPARQ_REALTIME
+    template <class T>
+    using DefaultQ = BoundedQ<T, SPARQ_QUEUE_CAPACITY>;
+#else
+    template <class T>
+    using DefaultQ = SafeQ<T>;
+#endif
+}
+
+#endif //SPARQ_DEFAULTQ_H
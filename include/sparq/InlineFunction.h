@@ -0,0 +1,146 @@
+#ifndef SPARQ_INLINEFUNCTION_H
+#define SPARQ_INLINEFUNCTION_H
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bytes of captured state a sparq callback can hold (timer callbacks,
+// subscribers, connector readers and writers).  Define it before including
+// any sparq header if your captures need more room.
+#ifndef SPARQ_CALLBACK_CAPACITY
+#define SPARQ_CALLBACK_CAPACITY 64
+#endif
+
+namespace sparq {
+    template <class Signature, size_t Capacity = SPARQ_CALLBACK_CAPACITY>
+    class InlineFunction;
+
+    // A std::function that never allocates.  The callable is stored in a
+    // buffer of Capacity bytes inside the InlineFunction itself, and one
+    // that does not fit is a compile error rather than a quiet trip to the
+    // heap.  It is move-only, so a callable that owns resources need not be
+    // copyable, and moving it never allocates either.
+    template <class R, class ... Args, size_t Capacity>
+    class InlineFunction<R(Args...), Capacity> {
+        struct Ops {
+            R (*invoke)(void *f, Args&& ... args);
+            void (*move)(void *to, void *from);
+            void (*destroy)(void *f);
+        };
+
+        template <class F>
+        struct OpsFor {
+            static R invoke(void *f, Args&& ... args) {
+                return (*static_cast<F*>(f))(std::forward<Args>(args)...);
+            }
+            static void move(void *to, void *from) {
+                new (to) F(std::move(*static_cast<F*>(from)));
+                static_cast<F*>(from)->~F();
+            }
+            static void destroy(void *f) {
+                static_cast<F*>(f)->~F();
+            }
+            static const Ops ops;
+        };
+
+        template <class F>
+        using Callable = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineFunction>::value &&
+                                                 !std::is_same<typename std::decay<F>::type, std::nullptr_t>::value>::type;
+
+    public:
+        InlineFunction() : ops(nullptr) {}
+
+        InlineFunction(std::nullptr_t) : ops(nullptr) {}
+
+        template <class F, class = Callable<F>>
+        InlineFunction(F&& f) : ops(nullptr) {
+            typedef typename std::decay<F>::type Fn;
+            static_assert(sizeof(Fn) <= Capacity,
+                          "callable is too big for this InlineFunction: capture less, or raise SPARQ_CALLBACK_CAPACITY");
+            static_assert(alignof(Fn) <= alignof(std::max_align_t), "callable is over-aligned for InlineFunction");
+            static_assert(std::is_nothrow_move_constructible<Fn>::value, "InlineFunction needs a callable with a noexcept move");
+            if (isNull(f)) return;
+            new (&storage) Fn(std::forward<F>(f));
+            ops = &OpsFor<Fn>::ops;
+        }
+
+        InlineFunction(InlineFunction &&other) noexcept : ops(other.ops) {
+            if (ops) {
+                ops->move(&storage, &other.storage);
+                other.ops = nullptr;
+            }
+        }
+
+        InlineFunction& operator=(InlineFunction &&other) noexcept {
+            if (this != &other) {
+                reset();
+                if (other.ops) {
+                    other.ops->move(&storage, &other.storage);
+                    ops = other.ops;
+                    other.ops = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        InlineFunction& operator=(std::nullptr_t) noexcept {
+            reset();
+            return *this;
+        }
+
+        InlineFunction(const InlineFunction &) = delete;
+        InlineFunction& operator=(const InlineFunction &) = delete;
+
+        ~InlineFunction() {
+            reset();
+        }
+
+        explicit operator bool() const {
+            return ops != nullptr;
+        }
+
+        // Like std::function, calling an empty one throws std::bad_function_call
+        R operator()(Args ... args) const {
+            if (!ops) throw std::bad_function_call();
+            return ops->invoke(const_cast<void*>(static_cast<const void*>(&storage)), std::forward<Args>(args)...);
+        }
+
+    private:
+        void reset() {
+            if (ops) {
+                ops->destroy(&storage);
+                ops = nullptr;
+            }
+        }
+
+        // Null function pointers and empty std::functions make an empty InlineFunction
+        template <class F>
+        static bool isNull(const F &) {
+            return false;
+        }
+
+        template <class T>
+        static bool isNull(T *p) {
+            return p == nullptr;
+        }
+
+        template <class S>
+        static bool isNull(const std::function<S> &f) {
+            return !f;
+        }
+
+        typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type storage;
+        const Ops *ops;
+    };
+
+    template <class R, class ... Args, size_t Capacity>
+    template <class F>
+    const typename InlineFunction<R(Args...), Capacity>::Ops InlineFunction<R(Args...), Capacity>::OpsFor<F>::ops = {
+        &OpsFor<F>::invoke, &OpsFor<F>::move, &OpsFor<F>::destroy
+    };
+}
+
+#endif //SPARQ_INLINEFUNCTION_H
@@ -0,0 +1,320 @@
+#ifndef SPARQ_INSTRUMENTEDQ_H
+#define SPARQ_INSTRUMENTEDQ_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+#include "SafeQ.h"
+
+namespace sparq {
+    // Log-linear histogram of durations in nanoseconds, in the style of
+    // HdrHistogram: values below 8 get a bucket each, and every power of
+    // two above that is split into 8 buckets, so any recorded value is
+    // known to within 12.5% across the whole 64 bit range.
+    class SojournHistogram {
+    public:
+        static const unsigned SubBits = 3;
+        static const unsigned SubCount = 1u << SubBits;
+        static const unsigned Buckets = (64 - SubBits + 1) * SubCount;
+
+        SojournHistogram() : counts() {}
+
+        static unsigned bucket(uint64_t ns) {
+            if (ns < SubCount) return static_cast<unsigned>(ns);
+            const unsigned msb = 63u - static_cast<unsigned>(__builtin_clzll(ns));
+            const unsigned shift = msb - SubBits;
+            return (shift + 1) * SubCount + static_cast<unsigned>((ns >> shift) & (SubCount - 1));
+        }
+
+        // Smallest value that lands in bucket i
+        static uint64_t lowest(unsigned i) {
+            if (i < SubCount) return i;
+            const unsigned shift = i / SubCount - 1;
+            return (static_cast<uint64_t>(SubCount) + i % SubCount) << shift;
+        }
+
+        void add(unsigned i, uint64_t n = 1) {
+            counts[i] += n;
+        }
+
+        uint64_t count(unsigned i) const {
+            return counts[i];
+        }
+
+        uint64_t total() const {
+            uint64_t n = 0;
+            for (unsigned i = 0; i < Buckets; i++) n += counts[i];
+            return n;
+        }
+
+        // Upper bound of the bucket holding the p-th percentile (0-100)
+        uint64_t percentile(double p) const {
+            const uint64_t n = total();
+            if (n == 0) return 0;
+            uint64_t rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(n));
+            if (rank >= n) rank = n - 1;
+            uint64_t seen = 0;
+            for (unsigned i = 0; i < Buckets; i++) {
+                seen += counts[i];
+                if (seen > rank) return (i + 1 < Buckets) ? lowest(i + 1) - 1 : UINT64_MAX;
+            }
+            return UINT64_MAX;
+        }
+
+    private:
+        uint64_t counts[Buckets];
+    };
+
+    // A consistent-enough copy of the counters of an InstrumentedQ
+    struct QueueStats {
+        uint64_t enqueued = 0;
+        uint64_t dequeued = 0;
+        uint64_t highWater = 0;  // deepest the queue has been
+        SojournHistogram sojourn;  // enqueue to dequeue, in nanoseconds
+
+        uint64_t depth() const {
+            return enqueued > dequeued ? enqueued - dequeued : 0;
+        }
+    };
+
+#ifdef SPARQ_QUEUE_STATS
+
+    // Wraps a queue with the SafeQ interface and records, per queue, the
+    // enqueue and dequeue counts, the depth high-water mark, and a
+    // histogram of how long each element sat in the queue.  Every element
+    // is timestamped at push.  stats() can be called from any thread while
+    // the queue is in use.
+    //
+    // Q is a queue template taking the element type; bind any other
+    // parameters with an alias:
+    //
+    //     template <class U> using Ring1k = sparq::RingQ<U, 1024>;
+    //     defineActiveFSMWithQueue(Widget, MyEventType, sparq::InstrumentedQ<MyEventType, Ring1k>) { ... };
+    //     auto s = Widget::queue().stats();
+    //
+    // The counters only exist when SPARQ_QUEUE_STATS is defined.  Without
+    // it an InstrumentedQ<T, Q> is just a Q<T> whose stats() are all zero,
+    // so the instrumentation can stay in the code at no cost.
+    template <class T, template <class...> class Q = SafeQ>
+    class InstrumentedQ {
+        using clock = std::chrono::steady_clock;
+
+        struct Stamped {
+            T value;
+            clock::time_point enqueued;
+
+            Stamped() : value(), enqueued() {}
+            Stamped(T&& v, clock::time_point when) : value(std::move(v)), enqueued(when) {}
+            Stamped(const T& v, clock::time_point when) : value(v), enqueued(when) {}
+        };
+
+        // Stamps the elements of a bulk push as the wrapped queue reads them,
+        // and counts how many it read
+        template <class It>
+        struct Stamper {
+            It it;
+            clock::time_point when;
+            size_t *count;
+
+            Stamped operator*() const {
+                return Stamped(*it, when);
+            }
+
+            Stamper& operator++() {
+                ++it;
+                ++*count;
+                return *this;
+            }
+
+            bool operator==(const Stamper &other) const {
+                return it == other.it;
+            }
+
+            bool operator!=(const Stamper &other) const {
+                return it != other.it;
+            }
+        };
+
+        // Batches are popped into a buffer of the popping thread, so that
+        // any number of consumers can pop at once; room for this many is
+        // made the first time a thread pops
+        static const size_t PopReserve = 64;
+
+        static std::vector<Stamped>& popped() {
+            static thread_local std::vector<Stamped> v;
+            if (v.capacity() == 0) v.reserve(PopReserve);
+            return v;
+        }
+
+    public:
+        InstrumentedQ() : enqueued(0), dequeued(0), highWater(0), buckets() {}
+
+        // Only what the wrapped queue accepts is counted: a BoundedQ that
+        // drops says so from push.  The elements a DropOldest BoundedQ
+        // evicts stay counted as enqueued, so depth() reads high by its
+        // dropped().
+        void push(const T& t) {
+            onPush(pushOne(q, Stamped(t, clock::now()), 0));
+        }
+
+        void push(T&& t) {
+            onPush(pushOne(q, Stamped(std::move(t), clock::now()), 0));
+        }
+
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            push(T(std::forward<Args>(args)...));
+        }
+
+        template <class It>
+        void pushBulk(It first, It last) {
+            if (first == last) return;
+            const auto now = clock::now();
+            size_t n = 0;
+            const size_t accepted = pushMany(q, Stamper<It>{first, now, &n}, Stamper<It>{last, now, &n}, n, 0);
+            onPush(accepted);
+        }
+
+        template <class Range>
+        void pushBulk(const Range& r) {
+            pushBulk(std::begin(r), std::end(r));
+        }
+
+        T pop() {
+            Stamped s = q.pop();
+            onPop(s, clock::now());
+            return std::move(s.value);
+        }
+
+        bool tryPop(T* p) {
+            Stamped s;
+            if (!q.tryPop(&s)) return false;
+            onPop(s, clock::now());
+            p[0] = std::move(s.value);
+            return true;
+        }
+
+        template <class S>
+        bool tryPopUntil(T* p, const S& when) {
+            Stamped s;
+            if (!q.tryPopUntil(&s, when)) return false;
+            onPop(s, clock::now());
+            p[0] = std::move(s.value);
+            return true;
+        }
+
+        size_t popBatch(std::vector<T> &out, size_t max) {
+            std::vector<Stamped> &p = popped();
+            q.popBatch(p, max);
+            return unstamp(p, out);
+        }
+
+        size_t tryPopBatch(std::vector<T> &out, size_t max) {
+            std::vector<Stamped> &p = popped();
+            q.tryPopBatch(p, max);
+            return unstamp(p, out);
+        }
+
+        template <class S>
+        size_t tryPopBatchUntil(std::vector<T> &out, size_t max, const S& when) {
+            std::vector<Stamped> &p = popped();
+            q.tryPopBatchUntil(p, max, when);
+            return unstamp(p, out);
+        }
+
+        size_t popAll(std::vector<T> &out) {
+            std::vector<Stamped> &p = popped();
+            q.popAll(p);
+            return unstamp(p, out);
+        }
+
+        void signal() {
+            q.signal();
+        }
+
+        QueueStats stats() const {
+            QueueStats s;
+            s.dequeued = dequeued.load(std::memory_order_relaxed);
+            s.enqueued = enqueued.load(std::memory_order_relaxed);
+            s.highWater = highWater.load(std::memory_order_relaxed);
+            for (unsigned i = 0; i < SojournHistogram::Buckets; i++)
+                s.sojourn.add(i, buckets[i].load(std::memory_order_relaxed));
+            return s;
+        }
+
+    private:
+        // The number of elements the wrapped queue took: what its push or
+        // pushBulk returns, or all of them if it returns nothing
+        template <class QQ>
+        static auto pushOne(QQ &qq, Stamped &&s, int) -> decltype(static_cast<size_t>(qq.push(std::move(s)))) {
+            return qq.push(std::move(s)) ? 1 : 0;
+        }
+
+        template <class QQ>
+        static size_t pushOne(QQ &qq, Stamped &&s, long) {
+            qq.push(std::move(s));
+            return 1;
+        }
+
+        template <class QQ, class It>
+        static auto pushMany(QQ &qq, It first, It last, const size_t &, int) -> decltype(static_cast<size_t>(qq.pushBulk(first, last))) {
+            return qq.pushBulk(first, last);
+        }
+
+        template <class QQ, class It>
+        static size_t pushMany(QQ &qq, It first, It last, const size_t &read, long) {
+            qq.pushBulk(first, last);
+            return read;
+        }
+
+        size_t unstamp(std::vector<Stamped> &p, std::vector<T> &out) {
+            const auto now = clock::now();
+            for (auto &s : p) {
+                onPop(s, now);
+                out.push_back(std::move(s.value));
+            }
+            const size_t n = p.size();
+            p.clear();
+            return n;
+        }
+
+        void onPush(size_t n) {
+            if (n == 0) return;
+            const uint64_t in = enqueued.fetch_add(n, std::memory_order_relaxed) + n;
+            const uint64_t out = dequeued.load(std::memory_order_relaxed);
+            const uint64_t depth = in > out ? in - out : 0;
+            uint64_t hw = highWater.load(std::memory_order_relaxed);
+            while (depth > hw && !highWater.compare_exchange_weak(hw, depth, std::memory_order_relaxed)) {}
+        }
+
+        void onPop(const Stamped &s, clock::time_point now) {
+            dequeued.fetch_add(1, std::memory_order_relaxed);
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - s.enqueued).count();
+            buckets[SojournHistogram::bucket(ns > 0 ? static_cast<uint64_t>(ns) : 0)]
+                    .fetch_add(1, std::memory_order_relaxed);
+        }
+
+        Q<Stamped> q;
+        std::atomic<uint64_t> enqueued;
+        std::atomic<uint64_t> dequeued;
+        std::atomic<uint64_t> highWater;
+        std::atomic<uint64_t> buckets[SojournHistogram::Buckets];
+    };
+
+#else
+
+    template <class T, template <class...> class Q = SafeQ>
+    class InstrumentedQ : public Q<T> {
+    public:
+        QueueStats stats() const {
+            return QueueStats();
+        }
+    };
+
+#endif
+}
+
+#endif //SPARQ_INSTRUMENTEDQ_H
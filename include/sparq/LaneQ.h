@@ -0,0 +1,194 @@
+#ifndef SPARQ_LANEQ_H
+#define SPARQ_LANEQ_H
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <queue>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include "RealTime.h"
+
+namespace sparq {
+    // A SafeQ with a small, fixed number of priority lanes.  Each lane is a
+    // FIFO, and pops always serve the highest numbered non-empty lane first,
+    // so an urgent event never waits behind a backlog of routine ones:
+    //
+    //     defineActiveFSMWithQueue(Widget, MyEventType, sparq::LaneQ<MyEventType, 4>) { ... };
+    //     Widget::push(Telemetry());        // lane 0, the lowest
+    //     Widget::push(Stop(), 3);          // jumps ahead of all the telemetry
+    //
+    // A bit mask tracks which lanes are non-empty, so finding the lane to
+    // serve is one count-leading-zeros; push and pop are O(1).  The plain
+    // SafeQ methods use lane 0, so a LaneQ drops in anywhere a SafeQ does.
+    template <class T, unsigned Lanes>
+    class LaneQ {
+        static_assert(Lanes >= 1 && Lanes <= 32, "LaneQ supports 1 to 32 lanes");
+    public:
+        LaneQ() : lanes(), active(0) {
+            initMutex(&mutex);
+            pthread_condattr_init(&condattr);
+            pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+            pthread_cond_init(&cond, &condattr);
+        }
+
+        void push(const T& t, unsigned lane = 0) {
+            assert(lane < Lanes);
+            pthread_mutex_lock(&mutex);
+            lanes[lane].push(t);
+            active |= (1u << lane);
+            pthread_mutex_unlock(&mutex);
+            pthread_cond_signal(&cond);
+        }
+
+        void push(T&& t, unsigned lane = 0) {
+            assert(lane < Lanes);
+            pthread_mutex_lock(&mutex);
+            lanes[lane].push(std::move(t));
+            active |= (1u << lane);
+            pthread_mutex_unlock(&mutex);
+            pthread_cond_signal(&cond);
+        }
+
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            pthread_mutex_lock(&mutex);
+            lanes[0].emplace(std::forward<Args>(args)...);
+            active |= 1u;
+            pthread_mutex_unlock(&mutex);
+            pthread_cond_signal(&cond);
+        }
+
+        template <class It>
+        void pushBulk(It first, It last, unsigned lane = 0) {
+            assert(lane < Lanes);
+            if (first == last) return;
+            pthread_mutex_lock(&mutex);
+            for (; first != last; ++first) lanes[lane].push(*first);
+            active |= (1u << lane);
+            pthread_mutex_unlock(&mutex);
+            pthread_cond_broadcast(&cond);
+        }
+
+        template <class Range>
+        void pushBulk(const Range& r, unsigned lane = 0) {
+            pushBulk(std::begin(r), std::end(r), lane);
+        }
+
+        T pop() {
+            pthread_mutex_lock(&mutex);
+            while (!active) pthread_cond_wait(&cond, &mutex);
+            T val = takeOne();
+            pthread_mutex_unlock(&mutex);
+            return val;
+        }
+
+        bool tryPop(T* p) {
+            pthread_mutex_lock(&mutex);
+            if (!active) pthread_cond_wait(&cond, &mutex);
+            if (!active) {
+                pthread_mutex_unlock(&mutex);
+                return false;
+            }
+            p[0] = takeOne();
+            pthread_mutex_unlock(&mutex);
+            return true;
+        }
+
+        template <class S>
+        bool tryPopUntil(T* p, const S& when) {
+            pthread_mutex_lock(&mutex);
+            if (!active) timedWait(when);
+            if (!active) {
+                pthread_mutex_unlock(&mutex);
+                return false;
+            }
+            p[0] = takeOne();
+            pthread_mutex_unlock(&mutex);
+            return true;
+        }
+
+        // Batches are filled from the highest lane down, keeping FIFO order
+        // within each lane.
+        size_t popBatch(std::vector<T> &out, size_t max) {
+            pthread_mutex_lock(&mutex);
+            while (!active) pthread_cond_wait(&cond, &mutex);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        size_t tryPopBatch(std::vector<T> &out, size_t max) {
+            pthread_mutex_lock(&mutex);
+            if (!active) pthread_cond_wait(&cond, &mutex);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        template <class S>
+        size_t tryPopBatchUntil(std::vector<T> &out, size_t max, const S& when) {
+            pthread_mutex_lock(&mutex);
+            if (!active) timedWait(when);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        size_t popAll(std::vector<T> &out) {
+            pthread_mutex_lock(&mutex);
+            const size_t n = take(out, std::numeric_limits<size_t>::max());
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        void signal() {
+            pthread_cond_signal(&cond);
+        }
+
+    private:
+        // The rest must be called with the mutex held
+        unsigned topLane() const {
+            return 31u - static_cast<unsigned>(__builtin_clz(active));
+        }
+
+        T takeOne() {
+            const unsigned lane = topLane();
+            T val = std::move(lanes[lane].front());
+            lanes[lane].pop();
+            if (lanes[lane].empty()) active &= ~(1u << lane);
+            return val;
+        }
+
+        size_t take(std::vector<T> &out, size_t max) {
+            size_t n = 0;
+            while (n < max && active) {
+                out.push_back(takeOne());
+                n++;
+            }
+            return n;
+        }
+
+        template <class S>
+        void timedWait(const S& when) {
+            const auto secs = std::chrono::time_point_cast<std::chrono::seconds>(when);
+            const auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(when - secs);
+            const struct timespec ts = {
+                static_cast<std::time_t>(secs.time_since_epoch().count()),
+                static_cast<long>(nsecs.count())
+            };
+            pthread_cond_timedwait(&cond, &mutex, &ts);
+        }
+
+        std::queue<T> lanes[Lanes];
+        uint32_t active;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        pthread_condattr_t condattr;
+    };
+}
+
+#endif //SPARQ_LANEQ_H
@@ -0,0 +1,271 @@
+#ifndef SPARQ_MPSCQ_H
+#define SPARQ_MPSCQ_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "Parker.h"
+
+namespace sparq {
+    // A queue for many producers and one consumer - the shape of an AFSM
+    // input - with the SafeQ interface:
+    //
+    //     defineActiveFSMWithQueue(Widget, MyEventType, sparq::MPSCQ<MyEventType>) { ... };
+    //
+    // It is D. Vyukov's intrusive MPSC queue: a push is one atomic exchange
+    // on the tail plus a store to link the previous node, and a pop is a
+    // couple of loads by the consumer, so producers never take a lock.
+    //
+    // Nodes come from a free list owned by the queue instead of the heap, so
+    // after warming up the queue stops allocating altogether.  The list is a
+    // lock-free stack addressed by node index, and its head carries a tag
+    // that is bumped on every change to rule out ABA between producers.
+    // Only growing the pool by another chunk of nodes takes a mutex.  The
+    // consumer parks only when the queue is empty.
+    //
+    // The pool grows as needed, one chunk of 1024 nodes at a time, up to
+    // MaxChunks chunks: by default about a million messages queued at once.
+    // A push that would need more throws std::bad_alloc.  A queue that
+    // must hold more takes a bigger MaxChunks (the table of chunks is part
+    // of the queue object, 8 bytes a chunk).
+    template <class T, uint32_t MaxChunks = 1024>
+    class MPSCQ {
+        struct Node {
+            std::atomic<Node*> next;
+            std::atomic<uint32_t> freeNext;  // index + 1 of the next free node, 0 at the end
+            uint32_t index;
+            T value;
+        };
+
+        static const uint32_t ChunkBits = 10;
+        static const uint32_t ChunkSize = 1u << ChunkBits;
+        static const uint64_t IndexMask = 0xffffffffull;
+        static const uint64_t TagInc = 1ull << 32;
+
+        // Node indexes are 32 bits, and the free list keeps them plus one
+        static_assert(MaxChunks > 0 && MaxChunks < (1u << (32 - ChunkBits)), "MPSCQ: MaxChunks out of range");
+
+    public:
+        MPSCQ() : freeHead(0), chunkCount(0) {
+            for (uint32_t i = 0; i < MaxChunks; i++) chunks[i].store(nullptr, std::memory_order_relaxed);
+            Node *stub = grow();
+            stub->next.store(nullptr, std::memory_order_relaxed);
+            head.store(stub, std::memory_order_relaxed);
+            tail = stub;
+        }
+
+        ~MPSCQ() {
+            const uint32_t n = chunkCount.load(std::memory_order_relaxed);
+            for (uint32_t i = 0; i < n; i++) delete[] chunks[i].load(std::memory_order_relaxed);
+        }
+
+        MPSCQ(const MPSCQ &) = delete;
+        MPSCQ& operator=(const MPSCQ &) = delete;
+
+        void push(const T& t) {
+            Node *n = acquire();
+            n->value = t;
+            link(n, n);
+            parker.notify();
+        }
+
+        void push(T&& t) {
+            Node *n = acquire();
+            n->value = std::move(t);
+            link(n, n);
+            parker.notify();
+        }
+
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            push(T(std::forward<Args>(args)...));
+        }
+
+        // Chains the nodes up privately and links the chain in with a single exchange
+        template <class It>
+        void pushBulk(It first, It last) {
+            if (first == last) return;
+            Node *chainHead = acquire();
+            Node *chainTail = chainHead;
+            try {
+                chainHead->value = *first;
+                for (++first; first != last; ++first) {
+                    Node *n = acquire();
+                    chainTail->next.store(n, std::memory_order_relaxed);
+                    chainTail = n;
+                    n->value = *first;
+                }
+            } catch (...) {
+                // Out of nodes: none of the chain is pushed, and its nodes go back to the pool
+                for (Node *n = chainHead; ; ) {
+                    Node *next = n->next.load(std::memory_order_relaxed);
+                    release(n);
+                    if (n == chainTail) break;
+                    n = next;
+                }
+                throw;
+            }
+            link(chainHead, chainTail);
+            parker.notify();
+        }
+
+        template <class Range>
+        void pushBulk(const Range& r) {
+            pushBulk(std::begin(r), std::end(r));
+        }
+
+        T pop() {
+            T val;
+            while (!dequeue(&val)) parker.park([this]() { return !empty(); });
+            return val;
+        }
+
+        bool tryPop(T* p) {
+            if (dequeue(p)) return true;
+            parker.parkOnce([this]() { return !empty(); });
+            return dequeue(p);
+        }
+
+        template <class S>
+        bool tryPopUntil(T* p, const S& when) {
+            if (dequeue(p)) return true;
+            parker.parkUntil([this]() { return !empty(); }, when);
+            return dequeue(p);
+        }
+
+        size_t popBatch(std::vector<T> &out, size_t max) {
+            size_t n;
+            while ((n = take(out, max)) == 0) parker.park([this]() { return !empty(); });
+            return n;
+        }
+
+        size_t tryPopBatch(std::vector<T> &out, size_t max) {
+            const size_t n = take(out, max);
+            if (n) return n;
+            parker.parkOnce([this]() { return !empty(); });
+            return take(out, max);
+        }
+
+        template <class S>
+        size_t tryPopBatchUntil(std::vector<T> &out, size_t max, const S& when) {
+            const size_t n = take(out, max);
+            if (n) return n;
+            parker.parkUntil([this]() { return !empty(); }, when);
+            return take(out, max);
+        }
+
+        size_t popAll(std::vector<T> &out) {
+            return take(out, std::numeric_limits<size_t>::max());
+        }
+
+        void signal() {
+            parker.signal();
+        }
+
+        // Consumer side only.  A push that is half way through linking its
+        // node reads as empty until it is done (and then wakes the consumer).
+        bool empty() const {
+            return tail->next.load(std::memory_order_acquire) == nullptr;
+        }
+
+        // Number of nodes in the pool, queued or free
+        size_t poolSize() const {
+            return static_cast<size_t>(chunkCount.load(std::memory_order_relaxed)) * ChunkSize;
+        }
+
+    private:
+        void link(Node *first, Node *last) {
+            last->next.store(nullptr, std::memory_order_relaxed);
+            Node *prev = head.exchange(last, std::memory_order_acq_rel);
+            prev->next.store(first, std::memory_order_release);
+        }
+
+        // The node at the tail is a stub whose value has already been taken;
+        // popping moves the value out of its successor, which becomes the new
+        // stub, and recycles the old one.
+        bool dequeue(T *p) {
+            Node *stub = tail;
+            Node *next = stub->next.load(std::memory_order_acquire);
+            if (!next) return false;
+            p[0] = std::move(next->value);
+            tail = next;
+            release(stub);
+            return true;
+        }
+
+        size_t take(std::vector<T> &out, size_t max) {
+            size_t n = 0;
+            T val;
+            while (n < max && dequeue(&val)) {
+                out.push_back(std::move(val));
+                n++;
+            }
+            return n;
+        }
+
+        Node* node(uint32_t index) const {
+            return &chunks[index >> ChunkBits].load(std::memory_order_acquire)[index & (ChunkSize - 1)];
+        }
+
+        Node* acquire() {
+            uint64_t top = freeHead.load(std::memory_order_acquire);
+            while (top & IndexMask) {
+                Node *n = node(static_cast<uint32_t>(top & IndexMask) - 1);
+                const uint64_t next = ((top & ~IndexMask) + TagInc) | n->freeNext.load(std::memory_order_relaxed);
+                if (freeHead.compare_exchange_weak(top, next, std::memory_order_acquire, std::memory_order_acquire))
+                    return n;
+            }
+            return grow();
+        }
+
+        void release(Node *n) {
+            releaseChain(n, n);
+        }
+
+        // first..last must already be chained through freeNext
+        void releaseChain(Node *first, Node *last) {
+            uint64_t top = freeHead.load(std::memory_order_relaxed);
+            uint64_t next;
+            do {
+                last->freeNext.store(static_cast<uint32_t>(top & IndexMask), std::memory_order_relaxed);
+                next = ((top & ~IndexMask) + TagInc) | (first->index + 1);
+            } while (!freeHead.compare_exchange_weak(top, next, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        // Adds a chunk to the pool, keeps its first node and frees the rest
+        Node* grow() {
+            std::lock_guard<std::mutex> guard(growLock);
+            const uint32_t c = chunkCount.load(std::memory_order_relaxed);
+            if (c == MaxChunks) throw std::bad_alloc();
+            Node *chunk = new Node[ChunkSize];
+            for (uint32_t i = 0; i < ChunkSize; i++) {
+                chunk[i].next.store(nullptr, std::memory_order_relaxed);
+                chunk[i].index = (c << ChunkBits) + i;
+                chunk[i].freeNext.store(i + 1 < ChunkSize ? chunk[i].index + 2 : 0, std::memory_order_relaxed);
+            }
+            chunks[c].store(chunk, std::memory_order_release);
+            chunkCount.store(c + 1, std::memory_order_relaxed);
+            releaseChain(&chunk[1], &chunk[ChunkSize - 1]);
+            return &chunk[0];
+        }
+
+        std::atomic<Node*> head;  // producers push here
+        char pad0[CacheLine - sizeof(std::atomic<Node*>)];
+        Node *tail;                // consumer pops here
+        char pad1[CacheLine - sizeof(Node*)];
+        std::atomic<uint64_t> freeHead;
+        char pad2[CacheLine - sizeof(std::atomic<uint64_t>)];
+        std::atomic<Node*> chunks[MaxChunks];
+        std::atomic<uint32_t> chunkCount;
+        std::mutex growLock;
+        Parker parker;
+    };
+}
+
+#endif //SPARQ_MPSCQ_H
@@ -0,0 +1,126 @@
+#ifndef SPARQ_PARKER_H
+#define SPARQ_PARKER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <pthread.h>
+#include "RealTime.h"
+
+namespace sparq {
+    // Used to keep hot atomics of the lock-free queues on their own cache lines.
+    static const size_t CacheLine = 64;
+
+    // Parks the consumer of a lock-free queue when the queue runs dry.
+    // Producers call notify() after publishing an element; it only enters
+    // the kernel when some consumer is actually parked, so the fast path is
+    // a fence and a load.  Consumers bump the sleeper count before they
+    // re-check the queue, and producers publish before they read it, so a
+    // wakeup can not be lost between the check and the wait.  Like SafeQ,
+    // the condition variable runs on the monotonic clock.
+    class Parker {
+    public:
+        Parker() : sleepers(0) {
+            initMutex(&mutex);
+            pthread_condattr_init(&condattr);
+            pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+            pthread_cond_init(&cond, &condattr);
+        }
+
+        ~Parker() {
+            pthread_cond_destroy(&cond);
+            pthread_condattr_destroy(&condattr);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        Parker(const Parker &) = delete;
+        Parker& operator=(const Parker &) = delete;
+
+        // Wake one parked consumer, if there is one.
+        void notify() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleepers.load(std::memory_order_relaxed) > 0) {
+                pthread_mutex_lock(&mutex);
+                pthread_cond_signal(&cond);
+                pthread_mutex_unlock(&mutex);
+            }
+        }
+
+        // Wake every parked consumer, if there are any.
+        void notifyAll() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleepers.load(std::memory_order_relaxed) > 0) {
+                pthread_mutex_lock(&mutex);
+                pthread_cond_broadcast(&cond);
+                pthread_mutex_unlock(&mutex);
+            }
+        }
+
+        // Unconditionally wake a parked consumer (see SafeQ::signal).
+        void signal() {
+            pthread_mutex_lock(&mutex);
+            pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        // Block until ready() holds.
+        template <class Pred>
+        void park(Pred ready) {
+            pthread_mutex_lock(&mutex);
+            enter();
+            while (!ready()) pthread_cond_wait(&cond, &mutex);
+            leave();
+            pthread_mutex_unlock(&mutex);
+        }
+
+        // Block at most once, unless ready() already holds.  Returns early
+        // on a signal() or a spurious wakeup, like SafeQ::tryPop.
+        template <class Pred>
+        void parkOnce(Pred ready) {
+            pthread_mutex_lock(&mutex);
+            enter();
+            if (!ready()) pthread_cond_wait(&cond, &mutex);
+            leave();
+            pthread_mutex_unlock(&mutex);
+        }
+
+        template <class Pred, class S>
+        void parkUntil(Pred ready, const S& when) {
+            const struct timespec ts = toTimespec(when);
+            pthread_mutex_lock(&mutex);
+            enter();
+            if (!ready()) pthread_cond_timedwait(&cond, &mutex, &ts);
+            leave();
+            pthread_mutex_unlock(&mutex);
+        }
+
+        template <class S>
+        static struct timespec toTimespec(const S& when) {
+            const auto secs = std::chrono::time_point_cast<std::chrono::seconds>(when);
+            const auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(when - secs);
+            const struct timespec ts = {
+                static_cast<std::time_t>(secs.time_since_epoch().count()),
+                static_cast<long>(nsecs.count())
+            };
+            return ts;
+        }
+
+    private:
+        void enter() {
+            sleepers.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        void leave() {
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        std::atomic<int> sleepers;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        pthread_condattr_t condattr;
+    };
+}
+
+#endif //SPARQ_PARKER_H
@@ -0,0 +1,215 @@
+#ifndef SPARQ_PARTITIONEDWORKQUEUE_H
+#define SPARQ_PARTITIONEDWORKQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Parker.h"
+#include "Thread.h"
+
+namespace sparq {
+    // A WorkQueue with several worker threads for messages that must be
+    // processed in order per key - per device, per session - but can run in
+    // parallel across keys.  Each message is pushed with its key, and the
+    // messages of one key are processed one at a time, in the order they
+    // were pushed, by whichever worker (shard) the key is on.
+    //
+    // A key lives on the shard its hash picks.  When that shard is backed
+    // up past rebalanceDepth, a key with nothing pending anywhere may be
+    // placed on the shallowest shard instead; since it has nothing pending,
+    // that can not reorder it.  Keys with pending messages never move.  The
+    // cost of this is a hash map lookup per push and per processed message,
+    // to track which keys have messages in flight.
+    //
+    // Subclasses implement process() (and optionally initialize(), which each
+    // worker calls once, on its own thread, before its first message), and
+    // shutdown() processes everything already pushed and joins the workers.
+    template <class Key, class MsgType, class Hash = std::hash<Key>>
+    class PartitionedWorkQueue {
+        struct Item {
+            Key key;
+            MsgType msg;
+            size_t home;
+        };
+
+        // Where a key's messages are queued, and how many are not yet processed
+        struct Route {
+            size_t shard;
+            size_t inflight;
+        };
+
+        struct Shard {
+            std::mutex lock;
+            std::deque<Item> q;
+            std::atomic<size_t> depth{0};
+            std::atomic<uint64_t> processed{0};
+            std::atomic<uint64_t> rebalanced{0};
+            Parker parker;
+            // Routes of the keys that hash to this shard
+            std::mutex routeLock;
+            std::unordered_map<Key, Route, Hash> routes;
+            Thread thread;
+            char pad[CacheLine];
+        };
+
+    public:
+        struct ShardStats {
+            size_t depth;         // messages queued and not yet taken by the worker
+            uint64_t processed;
+            uint64_t rebalanced;  // keys placed here because their own shard was hot
+        };
+
+        // A rebalanceDepth of zero keeps every key on its own shard.  The
+        // workers are started with the policy, numbered.
+        explicit PartitionedWorkQueue(size_t workers = std::thread::hardware_concurrency(), size_t rebalanceDepth = 256,
+                                      const ThreadPolicy &policy = ThreadPolicy())
+                : count(workers > 0 ? workers : 1), hotDepth(rebalanceDepth), shards(new Shard[count]), quit(false) {
+            for (size_t i = 0; i < count; i++)
+                shards[i].thread = Thread(policy.numbered(i), [this, i]() { run(i); });
+        }
+
+        virtual ~PartitionedWorkQueue() {
+            if (shards[0].thread.joinable()) {
+                shutdown();
+            }
+        }
+
+        void push(const Key &key, const MsgType &msg) {
+            enqueue(Item{key, msg, 0});
+        }
+
+        void push(const Key &key, MsgType &&msg) {
+            enqueue(Item{key, std::move(msg), 0});
+        }
+
+        // Waits for all the pushed messages to be processed, then stops the workers
+        void shutdown() {
+            quit.store(true, std::memory_order_relaxed);
+            for (size_t i = 0; i < count; i++) {
+                shards[i].parker.notifyAll();
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (shards[i].thread.joinable()) shards[i].thread.join();
+            }
+        }
+
+        size_t workers() const {
+            return count;
+        }
+
+        ShardStats stats(size_t shard) const {
+            const Shard &s = shards[shard];
+            return ShardStats{s.depth.load(std::memory_order_relaxed), s.processed.load(std::memory_order_relaxed),
+                              s.rebalanced.load(std::memory_order_relaxed)};
+        }
+
+    protected:
+        // A worker takes up to this many messages at a time from its shard
+        static const size_t BatchSize = 64;
+
+        virtual void initialize() {}
+        virtual void process(const Key &key, const MsgType &msg) = 0;
+
+    private:
+        void enqueue(Item &&item) {
+            item.home = hash(item.key) % count;
+            Shard &home = shards[item.home];
+            size_t dest;
+            {
+                std::lock_guard<std::mutex> guard(home.routeLock);
+                auto it = home.routes.find(item.key);
+                if (it != home.routes.end()) {
+                    dest = it->second.shard;
+                    it->second.inflight++;
+                } else {
+                    dest = place(item.home);
+                    home.routes.emplace(item.key, Route{dest, 1});
+                }
+            }
+            Shard &s = shards[dest];
+            {
+                // Counted before it can be taken, so the worker's decrement never goes below zero
+                std::lock_guard<std::mutex> guard(s.lock);
+                s.depth.fetch_add(1, std::memory_order_relaxed);
+                s.q.push_back(std::move(item));
+            }
+            s.parker.notify();
+        }
+
+        // The shard for a key with nothing in flight
+        size_t place(size_t home) {
+            const size_t homeDepth = shards[home].depth.load(std::memory_order_relaxed);
+            if (hotDepth == 0 || homeDepth < hotDepth) return home;
+            size_t best = home;
+            size_t bestDepth = homeDepth;
+            for (size_t i = 0; i < count; i++) {
+                const size_t d = shards[i].depth.load(std::memory_order_relaxed);
+                if (d < bestDepth) {
+                    best = i;
+                    bestDepth = d;
+                }
+            }
+            // Only worth it if the other shard is well behind
+            if (bestDepth * 2 > homeDepth) return home;
+            shards[best].rebalanced.fetch_add(1, std::memory_order_relaxed);
+            return best;
+        }
+
+        void finished(const Item &item) {
+            Shard &home = shards[item.home];
+            std::lock_guard<std::mutex> guard(home.routeLock);
+            auto it = home.routes.find(item.key);
+            if (--it->second.inflight == 0) home.routes.erase(it);
+        }
+
+        bool hasWork(const Shard &s) const {
+            return s.depth.load(std::memory_order_relaxed) > 0 || quit.load(std::memory_order_relaxed);
+        }
+
+        void run(size_t me) {
+            Shard &s = shards[me];
+            // Nothing runs until there is work, by which time the subclass is fully constructed
+            s.parker.park([this, &s]() { return hasWork(s); });
+            initialize();
+            std::vector<Item> batch;
+            batch.reserve(BatchSize);
+            while (1) {
+                batch.clear();
+                {
+                    std::lock_guard<std::mutex> guard(s.lock);
+                    while (!s.q.empty() && batch.size() < BatchSize) {
+                        batch.push_back(std::move(s.q.front()));
+                        s.q.pop_front();
+                    }
+                }
+                if (batch.empty()) {
+                    if (quit.load(std::memory_order_relaxed) && s.depth.load(std::memory_order_acquire) == 0) return;
+                    s.parker.park([this, &s]() { return hasWork(s); });
+                    continue;
+                }
+                s.depth.fetch_sub(batch.size(), std::memory_order_relaxed);
+                for (const auto &item : batch) {
+                    process(item.key, item.msg);
+                    finished(item);
+                    s.processed.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        const size_t count;
+        const size_t hotDepth;
+        Hash hash;
+        std::unique_ptr<Shard[]> shards;
+        std::atomic<bool> quit;
+    };
+}
+
+#endif //SPARQ_PARTITIONEDWORKQUEUE_H
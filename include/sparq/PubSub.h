@@ -5,44 +5,270 @@
 #ifndef SPARQ_PUBSUB_H_H
 #define SPARQ_PUBSUB_H_H
 
-#include <set>
-#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
 #include <map>
-#include <functional>
-#include <iostream>
-#include "SafeQ.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include "InlineFunction.h"
+#include "DefaultQ.h"
+#include "Thread.h"
 
 namespace sparq {
-    // A broadcasting thread safe pub-sub mechanism
-    template <class T, bool keepLast = false>
+    struct SubscriberStats {
+        uint64_t delivered = 0;  // messages the callback has been called with
+        uint64_t dropped = 0;    // overwritten in the queue before they could be delivered
+        size_t lag = 0;          // messages queued and not yet delivered
+        size_t maxLag = 0;       // the most lag there has been
+    };
+
+    // The delivery end of a PubSub::subscribeQueued subscription: a ring of
+    // a fixed capacity, filled by the PubSub thread, and a thread of its own
+    // that calls the subscriber's callback.  offer() never blocks: when the
+    // ring is full the oldest message is dropped to make room, so the
+    // subscriber sees the most recent messages, and a slow one falls behind
+    // on its own rather than holding up the topic.
+    template <class T>
+    class QueuedSubscriber {
+    public:
+        using callback = InlineFunction<void(const T& msg)>;
+
+        QueuedSubscriber(callback c, size_t capacity, const ThreadPolicy &policy)
+                : fn(std::move(c)), ring(capacity > 0 ? capacity : 1), head(0), count(0), quit(false), finished(false) {
+            worker = Thread(policy, [this]() { run(); });
+        }
+
+        // Not from the subscriber's own thread (see stop)
+        ~QueuedSubscriber() {
+            stop();
+            while (!finished.load(std::memory_order_acquire)) std::this_thread::yield();
+        }
+
+        void offer(const T &msg) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (count == ring.size()) {
+                    head = (head + 1) % ring.size();
+                    count--;
+                    counters.dropped++;
+                }
+                ring[(head + count) % ring.size()] = msg;
+                count++;
+                if (count > counters.maxLag) counters.maxLag = count;
+            }
+            cv.notify_one();
+        }
+
+        // Messages still queued are not delivered.  Called from the callback
+        // (which has unsubscribed itself) the thread cannot be joined, so it
+        // is detached, and the subscriber must not be freed until done().
+        void stop() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                quit = true;
+            }
+            cv.notify_one();
+            if (!worker.joinable()) return;
+            if (pthread_equal(pthread_self(), worker.native_handle())) {
+                worker.detach();
+            } else {
+                worker.join();
+            }
+        }
+
+        // Whether the thread has finished with the subscriber
+        bool done() const {
+            return finished.load(std::memory_order_acquire);
+        }
+
+        SubscriberStats stats() {
+            std::lock_guard<std::mutex> guard(lock);
+            SubscriberStats s = counters;
+            s.lag = count;
+            return s;
+        }
+
+    private:
+        // Messages are taken off the ring in batches of up to this many
+        static const size_t BatchSize = 64;
+
+        void run() {
+            std::vector<T> batch;
+            batch.reserve(BatchSize);
+            std::unique_lock<std::mutex> guard(lock);
+            while (1) {
+                cv.wait(guard, [this]() { return count > 0 || quit; });
+                if (quit) {
+                    guard.unlock();
+                    // The last use of this; the subscriber may be freed from here on
+                    finished.store(true, std::memory_order_release);
+                    return;
+                }
+                batch.clear();
+                while (count > 0 && batch.size() < BatchSize) {
+                    batch.push_back(std::move(ring[head]));
+                    head = (head + 1) % ring.size();
+                    count--;
+                }
+                guard.unlock();
+                size_t n = 0;
+                while (n < batch.size()) {
+                    fn(batch[n++]);
+                    // Stopped by the callback, or while it ran
+                    if (quit.load(std::memory_order_relaxed)) break;
+                }
+                guard.lock();
+                counters.delivered += n;
+            }
+        }
+
+        callback fn;
+        std::mutex lock;
+        std::condition_variable cv;
+        std::vector<T> ring;
+        size_t head;
+        size_t count;
+        std::atomic<bool> quit;
+        std::atomic<bool> finished;
+        SubscriberStats counters;
+        Thread worker;
+    };
+
+    // A broadcasting thread safe pub-sub mechanism.  Published messages are
+    // held in a DefaultQ by default; any type with the SafeQ interface will do.
+    //
+    // The subscribers are read by the PubSub thread from an immutable
+    // snapshot, an array of pointers to their callbacks, which subscribe and
+    // unsubscribe replace (read-copy-update).  Delivering a message is thus
+    // a pointer load and the calls, with no lock and no copying, and a
+    // subscriber can come or go while messages are being delivered.  The old
+    // snapshots, and the callbacks of subscribers that have gone, are freed
+    // by the PubSub thread between batches, once it can no longer be using
+    // them.
+    //
+    // Subscribers are called one after the other on the PubSub thread, so a
+    // slow one delays all the others.  A subscriber that may be slow (one
+    // that does I/O, say) should use subscribeQueued instead, which gives it
+    // a bounded queue and a thread of its own.
+    template <class T, bool keepLast = false, class Queue = DefaultQ<T>>
     class PubSub {
     public:
-        using callback = std::function<void(const T& msg)>;
-        PubSub() : msgQ(), lock(), listeners(), cv() {
-            std::thread t1(&PubSub::run, this);
+        using callback = InlineFunction<void(const T& msg)>;
+        explicit PubSub(const ThreadPolicy &policy = ThreadPolicy())
+                : msgQ(), lock(), current(new Snapshot()), retiredPending(false), quit(false), done(false) {
+            Thread t1(policy, [this]() { run(); });
             t1.detach();
         }
 
+        ~PubSub() {
+            stopQueued();
+            // Those that stopped themselves may still be in a call on this PubSub
+            std::vector<std::unique_ptr<QueuedSubscriber<T>>> q;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                q.swap(retiredQueued);
+            }
+            q.clear();
+            delete current.load(std::memory_order_relaxed);
+        }
+
         // Executes in the thread of the caller - will not block
         void publish(const T& msg) {
             this->msgQ.push(msg);
         }
 
+        void publish(T&& msg) {
+            this->msgQ.push(std::move(msg));
+        }
+
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            this->msgQ.emplace(std::forward<Args>(args)...);
+        }
+
+        // Subscribing again under the same name replaces the callback, and
+        // the queue and thread if it was subscribed with subscribeQueued
         void subscribe(const std::string& name, callback c) {
-            std::lock_guard<std::mutex> guard(lock);
-            this->listeners[name] = c;
+            std::unique_ptr<QueuedSubscriber<T>> replaced;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                std::unique_ptr<callback> &slot = subscribers[name];
+                if (slot) retiredCallbacks.push_back(std::move(slot));
+                slot.reset(new callback(std::move(c)));
+                auto qt = queued.find(name);
+                if (qt != queued.end()) {
+                    replaced = std::move(qt->second);
+                    queued.erase(qt);
+                }
+                republish();
+            }
+            retire(std::move(replaced));
+        }
+
+        // The callback runs on a thread of its own, fed through a queue of
+        // capacity messages that drops the oldest when it is full, so that
+        // this subscriber falling behind does not delay the others.
+        void subscribeQueued(const std::string& name, callback c, size_t capacity = 1024,
+                             const ThreadPolicy &policy = ThreadPolicy()) {
+            ThreadPolicy named(policy);
+            if (named.name.empty()) named.name = name;
+            std::unique_ptr<QueuedSubscriber<T>> q(new QueuedSubscriber<T>(std::move(c), capacity, named));
+            QueuedSubscriber<T> *target = q.get();
+            std::unique_ptr<QueuedSubscriber<T>> replaced;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                std::unique_ptr<callback> &slot = subscribers[name];
+                if (slot) retiredCallbacks.push_back(std::move(slot));
+                slot.reset(new callback([target](const T &msg) { target->offer(msg); }));
+                replaced = std::move(queued[name]);
+                queued[name] = std::move(q);
+                republish();
+            }
+            retire(std::move(replaced));
         }
 
         void unsubscribe(const std::string &name) {
+            std::unique_ptr<QueuedSubscriber<T>> q;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = subscribers.find(name);
+                if (it == subscribers.end()) return;
+                retiredCallbacks.push_back(std::move(it->second));
+                subscribers.erase(it);
+                auto qt = queued.find(name);
+                if (qt != queued.end()) {
+                    q = std::move(qt->second);
+                    queued.erase(qt);
+                }
+                republish();
+            }
+            retire(std::move(q));
+        }
+
+        // For subscribers added with subscribeQueued; all zero for others
+        SubscriberStats stats(const std::string &name) {
             std::lock_guard<std::mutex> guard(lock);
-            this->listeners.erase(name);
+            auto it = queued.find(name);
+            return it == queued.end() ? SubscriberStats() : it->second->stats();
         }
 
+        // Stops the PubSub thread; messages still queued are not delivered
         void stop() {
             std::unique_lock<std::mutex> guard(lock);
-            this->quit = true;
-            this->msgQ.signal();
-            cv.wait(guard);
+            quit.store(true, std::memory_order_release);
+            // The signal is lost if the thread is not waiting yet, so repeat it until it is done
+            while (!done) {
+                this->msgQ.signal();
+                cv.wait_for(guard, std::chrono::milliseconds(10));
+            }
+            guard.unlock();
+            stopQueued();
         }
 
         T last() {
@@ -52,29 +278,110 @@ namespace sparq {
         }
 
     private:
-        SafeQ<T> msgQ;
+        // Messages are drained from msgQ in batches of up to this many
+        static const size_t BatchSize = 64;
+
+        struct Snapshot {
+            std::vector<const callback*> callbacks;
+        };
+
+        // Call with the lock held
+        void republish() {
+            std::unique_ptr<Snapshot> next(new Snapshot());
+            next->callbacks.reserve(subscribers.size());
+            for (const auto &s : subscribers) {
+                next->callbacks.push_back(s.second.get());
+            }
+            retiredSnapshots.emplace_back(current.exchange(next.release(), std::memory_order_acq_rel));
+            retiredPending.store(true, std::memory_order_release);
+        }
+
+        // Called by the PubSub thread when it holds no snapshot
+        void reclaim() {
+            if (!retiredPending.load(std::memory_order_acquire)) return;
+            std::lock_guard<std::mutex> guard(lock);
+            retiredSnapshots.clear();
+            retiredCallbacks.clear();
+            sweepQueued();
+            retiredPending.store(!retiredQueued.empty(), std::memory_order_relaxed);
+        }
+
+        // Frees the retired queued subscribers whose threads are done with
+        // them, and keeps the ones that stopped themselves and are still
+        // returning from their callback.  Call with the lock held.
+        void sweepQueued() {
+            auto keep = retiredQueued.begin();
+            for (auto it = retiredQueued.begin(); it != retiredQueued.end(); ++it) {
+                if (!(*it)->done()) *keep++ = std::move(*it);
+            }
+            retiredQueued.erase(keep, retiredQueued.end());
+        }
+
+        // Stops the thread of a queued subscriber that has gone.  That is done
+        // without the lock, as its callback may be subscribing or unsubscribing.
+        // The PubSub thread may still offer it messages until it is reclaimed.
+        void retire(std::unique_ptr<QueuedSubscriber<T>> q) {
+            if (!q) return;
+            q->stop();
+            std::lock_guard<std::mutex> guard(lock);
+            retiredQueued.push_back(std::move(q));
+            retiredPending.store(true, std::memory_order_release);
+        }
+
+        // Once the PubSub thread is done, or the PubSub is going.  The ones
+        // still running are left to the destructor, which waits for them.
+        void stopQueued() {
+            std::map<std::string, std::unique_ptr<QueuedSubscriber<T>>> q;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                q.swap(queued);
+            }
+            for (auto &s : q) s.second->stop();
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto &s : q) retiredQueued.push_back(std::move(s.second));
+            sweepQueued();
+        }
+
+        Queue msgQ;
         std::mutex lock;
-        std::map<std::string,callback> listeners;
         std::condition_variable cv;
+        // The rest of the subscriber state is guarded by the lock
+        std::map<std::string, std::unique_ptr<callback>> subscribers;
+        std::atomic<Snapshot*> current;
+        std::vector<std::unique_ptr<Snapshot>> retiredSnapshots;
+        std::vector<std::unique_ptr<callback>> retiredCallbacks;
+        std::map<std::string, std::unique_ptr<QueuedSubscriber<T>>> queued;
+        std::vector<std::unique_ptr<QueuedSubscriber<T>>> retiredQueued;
+        std::atomic<bool> retiredPending;
+        std::atomic<bool> quit;
+        bool done;
         T lastMsg;
-        bool quit = false;
+
         void run() {
-            while (!quit) {
-                T obj;
-                auto msgAvail = this->msgQ.tryPop(&obj);
-                //std::cout << "Msg Avail: " << obj << " flag: " << msgAvail << "\n";
-                if (msgAvail) {
-                    for (auto t : this->listeners) {
-                        //std::cout << "Sending msg " << obj << " to listener " << t.first << "\n";
-                        t.second(obj);
-                    }
-                    if (keepLast) {
-                        this->lastMsg = obj;
+            std::vector<T> batch;
+            batch.reserve(BatchSize);
+            while (!quit.load(std::memory_order_acquire)) {
+                batch.clear();
+                reclaim();
+                this->msgQ.tryPopBatch(batch, BatchSize);
+                const Snapshot *s = current.load(std::memory_order_acquire);
+                for (const auto &obj : batch) {
+                    for (const callback *c : s->callbacks) {
+                        (*c)(obj);
                     }
                 }
+                if (keepLast && !batch.empty()) {
+                    std::lock_guard<std::mutex> guard(lock);
+                    this->lastMsg = std::move(batch.back());
+                }
             }
-            //std::cout << "Shutting down pubsub";
-            listeners.clear();
+            std::lock_guard<std::mutex> guard(lock);
+            subscribers.clear();
+            republish();
+            retiredSnapshots.clear();
+            retiredCallbacks.clear();
+            sweepQueued();
+            done = true;
             cv.notify_all();
         }
     };
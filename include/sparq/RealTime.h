@@ -0,0 +1,166 @@
+#ifndef SPARQ_REALTIME_H
+#define SPARQ_REALTIME_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// Real time configuration.  Define SPARQ_REALTIME (before including any
+// sparq header, or for the whole build) to have sparq stay off the heap
+// once it is running:
+//
+//  - AFSMs, WorkQueues and PubSubs default to a BoundedQ of
+//    SPARQ_QUEUE_CAPACITY elements rather than a SafeQ, so pushes never
+//    allocate.  A full queue blocks the producer instead of growing,
+//    except when an AFSM pushes to its own queue (see below),
+//  - TimeQs and TimerWheels make room for SPARQ_TIMER_CAPACITY timers up
+//    front and add returns NoTimer past it; a DeadlineQ holds at most
+//    SPARQ_QUEUE_CAPACITY messages and rejects pushes past that,
+//  - the queue and Parker mutexes use priority inheritance, so a low
+//    priority producer holding one is boosted while a high priority
+//    consumer waits on it.
+//
+// A bounded queue that blocks deadlocks a consumer that pushes to its own
+// queue when it is full: an AFSM's timers and the handlers that post their
+// own FSM an event do just that.  So an AFSM's own thread never waits: an
+// event it pushes to its own full queue is dropped, push returns false,
+// and the event is counted in selfDropped() and handed to the hook set
+// with setDropHook().  Other threads still wait for room.  A
+// WorkQueue or PubSub whose own thread pushes to it (a WorkQueue that
+// requeues a message, a subscriber that publishes on the same PubSub)
+// needs a BoundedQ with a policy that does not block, or a capacity it
+// can not reach.  Its drops show in the queue's dropped().
+//
+// WorkQueuePool and PartitionedWorkQueue are the exceptions: their
+// per-worker and per-shard queues are std::deques that grow with the
+// backlog, so keep them out of the real time path.
+//
+// Memory is locked with lockMemory(), and an application that wants to be
+// sure can replace operator new with SPARQ_ALLOCATION_TRAP() and arm the
+// trap once everything is up; see AllocationTrap below.
+#ifndef SPARQ_QUEUE_CAPACITY
+#define SPARQ_QUEUE_CAPACITY 1024
+#endif
+
+#ifndef SPARQ_TIMER_CAPACITY
+#define SPARQ_TIMER_CAPACITY 256
+#endif
+
+namespace sparq {
+    // Initializes a mutex of a sparq queue: a plain one, or with
+    // SPARQ_REALTIME one with priority inheritance.
+    inline void initMutex(pthread_mutex_t *mutex) {
+#ifdef SPARQ_REALTIME
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+        pthread_mutex_init(mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+#else
+        pthread_mutex_init(mutex, NULL);
+#endif
+    }
+
+    // Locks the pages of the process, present and future, into memory so
+    // that none of them is ever paged out.  Call it early in main(), before
+    // the threads start, so that their stacks are locked too.  Needs
+    // CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK; returns false without.
+    inline bool lockMemory() {
+        return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+    }
+
+    // Catches heap allocations made on sparq threads (the threads of AFSMs,
+    // WorkQueues, PubSubs and the rest, including the handlers and callbacks
+    // that run on them) after the application has finished starting up.
+    // It works through a replacement operator new, which one source file of
+    // the application defines with
+    //
+    //     SPARQ_ALLOCATION_TRAP()
+    //
+    // at namespace scope.  Once arm() is called, an allocation on a sparq
+    // thread calls the hook, which by default reports it and aborts, so it
+    // can be caught in a debugger.  Arm it once every thread has handled
+    // its first message, as some of them size their buffers only then.
+    // Without SPARQ_ALLOCATION_TRAP() the trap is never consulted.
+    class AllocationTrap {
+    public:
+        typedef void (*hook_t)(size_t bytes);
+
+        static void arm() {
+            state().armed.store(true, std::memory_order_release);
+        }
+
+        static void disarm() {
+            state().armed.store(false, std::memory_order_release);
+        }
+
+        static void setHook(hook_t hook) {
+            state().hook.store(hook ? hook : &abortOnAllocation, std::memory_order_release);
+        }
+
+        // Called by sparq::Thread on each thread it starts
+        static void markThread() {
+            flags().sparq = true;
+        }
+
+        // Called by the replacement operator new
+        static void check(size_t bytes) {
+            Flags &f = flags();
+            if (!f.sparq || f.inHook || !state().armed.load(std::memory_order_relaxed)) return;
+            f.inHook = true;
+            state().hook.load(std::memory_order_acquire)(bytes);
+            f.inHook = false;
+        }
+
+    private:
+        struct State {
+            std::atomic<bool> armed;
+            std::atomic<hook_t> hook;
+            State() : armed(false), hook(&abortOnAllocation) {}
+        };
+
+        struct Flags {
+            bool sparq;
+            bool inHook;
+        };
+
+        static void abortOnAllocation(size_t bytes) {
+            std::fprintf(stderr, "sparq: %zu byte heap allocation on a real time thread\n", bytes);
+            std::abort();
+        }
+
+        static State& state() {
+            static State s;
+            return s;
+        }
+
+        static Flags& flags() {
+            static thread_local Flags f = {false, false};
+            return f;
+        }
+    };
+}
+
+// Replaces the global operator new (and new[]) with one that checks the
+// AllocationTrap.  Expand in exactly one source file of the application.
+#define SPARQ_ALLOCATION_TRAP() \
+    void* operator new(std::size_t n) { \
+        sparq::AllocationTrap::check(n); \
+        if (void *p = std::malloc(n ? n : 1)) return p; \
+        throw std::bad_alloc(); \
+    } \
+    void* operator new[](std::size_t n) { \
+        return ::operator new(n); \
+    } \
+    void operator delete(void *p) noexcept { \
+        std::free(p); \
+    } \
+    void operator delete[](void *p) noexcept { \
+        std::free(p); \
+    }
+
+#endif //SPARQ_REALTIME_H
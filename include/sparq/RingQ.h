@@ -0,0 +1,215 @@
+#ifndef SPARQ_RINGQ_H
+#define SPARQ_RINGQ_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Parker.h"
+
+namespace sparq {
+    // A fixed capacity, lock-free, multi-producer/multi-consumer ring with
+    // the same interface as SafeQ, so it can be dropped into an AFSM,
+    // WorkQueue or PubSub through their queue template parameter:
+    //
+    //     defineActiveFSMWithQueue(Widget, MyEventType, sparq::RingQ<MyEventType, 1024>) { ... };
+    //
+    // Each cell carries a sequence number that tells producers and consumers
+    // whose turn it is (D. Vyukov's bounded MPMC queue), so a push or pop is
+    // one CAS on the shared position plus a release store on the cell.  The
+    // two positions live on their own cache lines.  Consumers only block in
+    // the kernel when the ring is empty; producers that find it full yield
+    // until a slot frees up, so a consumer must never push() to its own
+    // full ring: nothing else would free the slot.  tryPush never waits,
+    // and an AFSM uses it for the events it pushes to itself (timers, self
+    // posts), dropping and counting those that do not fit.
+    template <class T, size_t Capacity>
+    class RingQ {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                      "RingQ capacity must be a power of two");
+    public:
+        RingQ() : cells(new Cell[Capacity]) {
+            for (size_t i = 0; i < Capacity; i++)
+                cells[i].seq.store(i, std::memory_order_relaxed);
+            enqueuePos.store(0, std::memory_order_relaxed);
+            dequeuePos.store(0, std::memory_order_relaxed);
+        }
+
+        void push(const T& t) {
+            while (!enqueue(t)) std::this_thread::yield();
+            parker.notify();
+        }
+
+        void push(T&& t) {
+            while (!enqueue(std::move(t))) std::this_thread::yield();
+            parker.notify();
+        }
+
+        // Never waits: false if the ring is full
+        bool tryPush(const T& t) {
+            if (!enqueue(t)) return false;
+            parker.notify();
+            return true;
+        }
+
+        bool tryPush(T&& t) {
+            if (!enqueue(std::move(t))) return false;
+            parker.notify();
+            return true;
+        }
+
+        // The cells are constructed up front, so this builds the element and
+        // moves it into its cell.
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            push(T(std::forward<Args>(args)...));
+        }
+
+        template <class It>
+        void pushBulk(It first, It last) {
+            if (first == last) return;
+            for (; first != last; ++first) {
+                while (!enqueue(*first)) {
+                    // Full part way through: let the consumers drain what is there
+                    parker.notifyAll();
+                    std::this_thread::yield();
+                }
+            }
+            parker.notifyAll();
+        }
+
+        template <class Range>
+        void pushBulk(const Range& r) {
+            pushBulk(std::begin(r), std::end(r));
+        }
+
+        T pop() {
+            T val;
+            while (!dequeue(&val)) parker.park([this]() { return !empty(); });
+            return val;
+        }
+
+        bool tryPop(T* p) {
+            if (dequeue(p)) return true;
+            parker.parkOnce([this]() { return !empty(); });
+            return dequeue(p);
+        }
+
+        template <class S>
+        bool tryPopUntil(T* p, const S& when) {
+            if (dequeue(p)) return true;
+            parker.parkUntil([this]() { return !empty(); }, when);
+            return dequeue(p);
+        }
+
+        size_t popBatch(std::vector<T> &out, size_t max) {
+            size_t n;
+            while ((n = take(out, max)) == 0) parker.park([this]() { return !empty(); });
+            return n;
+        }
+
+        size_t tryPopBatch(std::vector<T> &out, size_t max) {
+            const size_t n = take(out, max);
+            if (n) return n;
+            parker.parkOnce([this]() { return !empty(); });
+            return take(out, max);
+        }
+
+        template <class S>
+        size_t tryPopBatchUntil(std::vector<T> &out, size_t max, const S& when) {
+            const size_t n = take(out, max);
+            if (n) return n;
+            parker.parkUntil([this]() { return !empty(); }, when);
+            return take(out, max);
+        }
+
+        size_t popAll(std::vector<T> &out) {
+            return take(out, std::numeric_limits<size_t>::max());
+        }
+
+        void signal() {
+            parker.signal();
+        }
+
+        bool empty() const {
+            const size_t pos = dequeuePos.load(std::memory_order_acquire);
+            return cells[pos & (Capacity - 1)].seq.load(std::memory_order_acquire) != pos + 1;
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> seq;
+            T data;
+        };
+
+        // Only consumes u once a cell has been claimed, so a failed attempt
+        // can be retried with the same argument.
+        template <class U>
+        bool enqueue(U &&u) {
+            Cell *cell;
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            for (;;) {
+                cell = &cells[pos & (Capacity - 1)];
+                const size_t seq = cell->seq.load(std::memory_order_acquire);
+                const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                if (dif == 0) {
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (dif < 0) {
+                    return false;
+                } else {
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data = std::forward<U>(u);
+            cell->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        size_t take(std::vector<T> &out, size_t max) {
+            size_t n = 0;
+            T val;
+            while (n < max && dequeue(&val)) {
+                out.push_back(std::move(val));
+                n++;
+            }
+            return n;
+        }
+
+        bool dequeue(T *p) {
+            Cell *cell;
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            for (;;) {
+                cell = &cells[pos & (Capacity - 1)];
+                const size_t seq = cell->seq.load(std::memory_order_acquire);
+                const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                if (dif == 0) {
+                    if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (dif < 0) {
+                    return false;
+                } else {
+                    pos = dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+            p[0] = std::move(cell->data);
+            cell->seq.store(pos + Capacity, std::memory_order_release);
+            return true;
+        }
+
+        char pad0[CacheLine];
+        std::atomic<size_t> enqueuePos;
+        char pad1[CacheLine - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> dequeuePos;
+        char pad2[CacheLine - sizeof(std::atomic<size_t>)];
+        std::unique_ptr<Cell[]> cells;
+        Parker parker;
+    };
+}
+
+#endif //SPARQ_RINGQ_H
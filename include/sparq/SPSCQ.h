@@ -0,0 +1,198 @@
+#ifndef SPARQ_SPSCQ_H
+#define SPARQ_SPSCQ_H
+
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Parker.h"
+
+namespace sparq {
+    // A fixed capacity channel for exactly one producer thread and one
+    // consumer thread, with the SafeQ interface.  Use it for a WorkQueue
+    // fed by a single pusher that the WorkQueue never pushes to itself:
+    //
+    //     class Writer : public sparq::WorkQueue<Record, sparq::SPSCQ<Record, 1024>> { ... };
+    //
+    // Each side owns its index and keeps a cached copy of the other side's,
+    // so a push or pop normally touches no shared cache line except the
+    // element itself and is a plain acquire/release exchange.  The only
+    // other cost on the push side is the fence the Parker needs to tell
+    // whether the consumer is asleep.  The consumer parks only when the
+    // channel is empty; a producer that finds it full yields.
+    //
+    // Nothing checks that there really is only one producer and one
+    // consumer - using it from more threads corrupts the channel.  That
+    // rules out AFSM inputs in practice: an AFSM's timers, and handlers
+    // that post to their own FSM, push from the FSM's thread, which makes
+    // the consumer a second producer, and one that spins forever on a full
+    // channel that only it can drain.  An SPSCQ only works for an FSM with
+    // no timers and no self posts, fed by a single thread.
+    template <class T, size_t Capacity>
+    class SPSCQ {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                      "SPSCQ capacity must be a power of two");
+    public:
+        SPSCQ() : cachedTail(0), cachedHead(0), slots(new T[Capacity]) {
+            head.store(0, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+        }
+
+        void push(const T& t) {
+            slots[claim() & (Capacity - 1)] = t;
+            publish();
+        }
+
+        void push(T&& t) {
+            slots[claim() & (Capacity - 1)] = std::move(t);
+            publish();
+        }
+
+        // The slots are constructed up front, so this builds the element and
+        // moves it into its slot.
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            slots[claim() & (Capacity - 1)] = T(std::forward<Args>(args)...);
+            publish();
+        }
+
+        // Publishes the whole range with a single index update and wakeup,
+        // unless the channel fills up part way through.
+        template <class It>
+        void pushBulk(It first, It last) {
+            if (first == last) return;
+            size_t pos = tail.load(std::memory_order_relaxed);
+            for (; first != last; ++first) {
+                while (pos - cachedHead >= Capacity) {
+                    cachedHead = head.load(std::memory_order_acquire);
+                    if (pos - cachedHead >= Capacity) {
+                        tail.store(pos, std::memory_order_release);
+                        parker.notify();
+                        std::this_thread::yield();
+                    }
+                }
+                slots[pos & (Capacity - 1)] = *first;
+                pos++;
+            }
+            tail.store(pos, std::memory_order_release);
+            parker.notify();
+        }
+
+        template <class Range>
+        void pushBulk(const Range& r) {
+            pushBulk(std::begin(r), std::end(r));
+        }
+
+        T pop() {
+            T val;
+            while (!dequeue(&val)) parker.park([this]() { return !empty(); });
+            return val;
+        }
+
+        bool tryPop(T* p) {
+            if (dequeue(p)) return true;
+            parker.parkOnce([this]() { return !empty(); });
+            return dequeue(p);
+        }
+
+        template <class S>
+        bool tryPopUntil(T* p, const S& when) {
+            if (dequeue(p)) return true;
+            parker.parkUntil([this]() { return !empty(); }, when);
+            return dequeue(p);
+        }
+
+        size_t popBatch(std::vector<T> &out, size_t max) {
+            size_t n;
+            while ((n = take(out, max)) == 0) parker.park([this]() { return !empty(); });
+            return n;
+        }
+
+        size_t tryPopBatch(std::vector<T> &out, size_t max) {
+            const size_t n = take(out, max);
+            if (n) return n;
+            parker.parkOnce([this]() { return !empty(); });
+            return take(out, max);
+        }
+
+        template <class S>
+        size_t tryPopBatchUntil(std::vector<T> &out, size_t max, const S& when) {
+            const size_t n = take(out, max);
+            if (n) return n;
+            parker.parkUntil([this]() { return !empty(); }, when);
+            return take(out, max);
+        }
+
+        size_t popAll(std::vector<T> &out) {
+            return take(out, std::numeric_limits<size_t>::max());
+        }
+
+        void signal() {
+            parker.signal();
+        }
+
+        bool empty() const {
+            return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+        }
+
+    private:
+        // Waits for a free slot and returns its position
+        size_t claim() {
+            const size_t pos = tail.load(std::memory_order_relaxed);
+            while (pos - cachedHead >= Capacity) {
+                cachedHead = head.load(std::memory_order_acquire);
+                if (pos - cachedHead >= Capacity) std::this_thread::yield();
+            }
+            return pos;
+        }
+
+        void publish() {
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            parker.notify();
+        }
+
+        // Takes everything up to max with a single index update
+        size_t take(std::vector<T> &out, size_t max) {
+            const size_t pos = head.load(std::memory_order_relaxed);
+            if (pos == cachedTail) {
+                cachedTail = tail.load(std::memory_order_acquire);
+                if (pos == cachedTail) return 0;
+            }
+            size_t n = cachedTail - pos;
+            if (n > max) n = max;
+            for (size_t i = 0; i < n; i++)
+                out.push_back(std::move(slots[(pos + i) & (Capacity - 1)]));
+            head.store(pos + n, std::memory_order_release);
+            return n;
+        }
+
+        bool dequeue(T *p) {
+            const size_t pos = head.load(std::memory_order_relaxed);
+            if (pos == cachedTail) {
+                cachedTail = tail.load(std::memory_order_acquire);
+                if (pos == cachedTail) return false;
+            }
+            p[0] = std::move(slots[pos & (Capacity - 1)]);
+            head.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side
+        char pad0[CacheLine];
+        std::atomic<size_t> head;
+        size_t cachedTail;
+        char pad1[CacheLine - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+        // Producer side
+        std::atomic<size_t> tail;
+        size_t cachedHead;
+        char pad2[CacheLine - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+        std::unique_ptr<T[]> slots;
+        Parker parker;
+    };
+}
+
+#endif //SPARQ_SPSCQ_H
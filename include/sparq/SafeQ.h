@@ -10,8 +10,15 @@
 #include <queue>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <chrono>
+#include <iterator>
+#include <limits>
+#include <utility>
+#include <vector>
 #include <pthread.h>
+#include "RealTime.h"
+#include "WaitPolicy.h"
 
 namespace sparq {
     // SafeQ uses the POSIX pthread API so that it can wait based on a
@@ -22,60 +29,117 @@ namespace sparq {
     // portable than the C++ standard library (i.e. no Windows support),
     // but avoids race conditions that could cause a timeout to be delayed
     // by an arbitrary amount (or time out too soon).
-    template <class T>
+    //
+    // The WaitPolicy decides what a consumer does before it blocks on an
+    // empty queue (see WaitPolicy.h), e.g. SafeQ<Event, SpinWait<2000>>.
+    // With a polling policy the queue also counts which phase of the wait
+    // found data (waitStats), so the policy can be tuned per queue.
+    template <class T, class WaitPolicy = BlockingWait>
     class SafeQ {
     public:
-        SafeQ() : queue() {
-            pthread_mutex_init(&mutex, NULL);
+        SafeQ() : queue(), depth(0) {
+            initMutex(&mutex);
             pthread_condattr_init(&condattr);
             pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
             pthread_cond_init(&cond, &condattr);
         }
 
-        void push(T t) {
+        void push(const T& t) {
             pthread_mutex_lock(&mutex);
             queue.push(t);
+            updateDepth();
             pthread_mutex_unlock(&mutex);
             pthread_cond_signal(&cond);
         }
 
+        void push(T&& t) {
+            pthread_mutex_lock(&mutex);
+            queue.push(std::move(t));
+            updateDepth();
+            pthread_mutex_unlock(&mutex);
+            pthread_cond_signal(&cond);
+        }
+
+        // Constructs the element in place at the back of the queue
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            pthread_mutex_lock(&mutex);
+            queue.emplace(std::forward<Args>(args)...);
+            updateDepth();
+            pthread_mutex_unlock(&mutex);
+            pthread_cond_signal(&cond);
+        }
+
+        // Pushes [first, last) under a single lock and a single wakeup.
+        template <class It>
+        void pushBulk(It first, It last) {
+            if (first == last) return;
+            pthread_mutex_lock(&mutex);
+            for (; first != last; ++first) queue.push(*first);
+            updateDepth();
+            pthread_mutex_unlock(&mutex);
+            pthread_cond_broadcast(&cond);
+        }
+
+        template <class Range>
+        void pushBulk(const Range& r) {
+            pushBulk(std::begin(r), std::end(r));
+        }
+
         T pop() {
+            WaitPhase phase = poll();
             pthread_mutex_lock(&mutex);
-            while (queue.empty()) pthread_cond_wait(&cond, &mutex);
-            T val = queue.front();
+            if (queue.empty()) {
+                phase = WaitPhase::Park;
+                while (queue.empty()) pthread_cond_wait(&cond, &mutex);
+            } else {
+                phase = unparked(phase);
+            }
+            record(phase);
+            T val = std::move(queue.front());
             queue.pop();
+            updateDepth();
             pthread_mutex_unlock(&mutex);
             return val;
         }
 
         bool tryPop(T* p) {
+            const WaitPhase phase = poll();
             pthread_mutex_lock(&mutex);
             if (!queue.empty()) {
-                p[0] = queue.front();
+                record(unparked(phase));
+                p[0] = std::move(queue.front());
                 queue.pop();
+                updateDepth();
                 pthread_mutex_unlock(&mutex);
                 return true;
             }
+            record(WaitPhase::Park);
             pthread_cond_wait(&cond, &mutex);
             if (queue.empty()) {
                 pthread_mutex_unlock(&mutex);
                 return false;
             }
-            p[0] = queue.front();
+            p[0] = std::move(queue.front());
             queue.pop();
+            updateDepth();
             pthread_mutex_unlock(&mutex);
             return true;
         }
 
         template <class S>
         bool tryPopUntil(T* p, const S& when) {
+            const WaitPhase phase = poll();
             pthread_mutex_lock(&mutex);
             if (!queue.empty()) {
-                p[0] = queue.front();
+                record(unparked(phase));
+                p[0] = std::move(queue.front());
                 queue.pop();
+                updateDepth();
                 pthread_mutex_unlock(&mutex);
                 return true;
             }
+            record(WaitPhase::Park);
 
             const auto secs = std::chrono::time_point_cast<std::chrono::seconds>(when);
             const auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(when - secs);
@@ -90,17 +154,122 @@ namespace sparq {
                 pthread_mutex_unlock(&mutex);
                 return false;
             }
-            p[0] = queue.front();
+            p[0] = std::move(queue.front());
             queue.pop();
+            updateDepth();
             pthread_mutex_unlock(&mutex);
             return true;
         }
 
+        // The batch pops append up to max elements to out under a single
+        // lock, and return how many were taken.  popBatch blocks like pop,
+        // tryPopBatch and tryPopBatchUntil wait like tryPop and tryPopUntil,
+        // and popAll takes whatever is queued without waiting.
+        size_t popBatch(std::vector<T> &out, size_t max) {
+            WaitPhase phase = poll();
+            pthread_mutex_lock(&mutex);
+            if (queue.empty()) {
+                phase = WaitPhase::Park;
+                while (queue.empty()) pthread_cond_wait(&cond, &mutex);
+            } else {
+                phase = unparked(phase);
+            }
+            record(phase);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        size_t tryPopBatch(std::vector<T> &out, size_t max) {
+            WaitPhase phase = poll();
+            pthread_mutex_lock(&mutex);
+            if (queue.empty()) {
+                phase = WaitPhase::Park;
+                pthread_cond_wait(&cond, &mutex);
+            } else {
+                phase = unparked(phase);
+            }
+            record(phase);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        template <class S>
+        size_t tryPopBatchUntil(std::vector<T> &out, size_t max, const S& when) {
+            WaitPhase phase = poll();
+            pthread_mutex_lock(&mutex);
+            if (queue.empty()) {
+                phase = WaitPhase::Park;
+                const auto secs = std::chrono::time_point_cast<std::chrono::seconds>(when);
+                const auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(when - secs);
+                const struct timespec ts = {
+                    static_cast<std::time_t>(secs.time_since_epoch().count()),
+                    static_cast<long>(nsecs.count())
+                };
+                pthread_cond_timedwait(&cond, &mutex, &ts);
+            } else {
+                phase = unparked(phase);
+            }
+            record(phase);
+            const size_t n = take(out, max);
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
+        size_t popAll(std::vector<T> &out) {
+            pthread_mutex_lock(&mutex);
+            const size_t n = take(out, std::numeric_limits<size_t>::max());
+            pthread_mutex_unlock(&mutex);
+            return n;
+        }
+
         void signal() {
             pthread_cond_signal(&cond);
         }
+
+        // Only counted for polling wait policies
+        WaitStats waitStats() const {
+            return counters.snapshot();
+        }
     private:
+        // Runs the busy phases of the wait policy without the lock held
+        WaitPhase poll() {
+            return WaitPolicy::wait([this]() { return depth.load(std::memory_order_relaxed) > 0; });
+        }
+
+        // The phase to count when the lock found data after poll() gave up:
+        // the consumer did not park, so it is counted with the last polling
+        static WaitPhase unparked(WaitPhase phase) {
+            if (phase != WaitPhase::Park) return phase;
+            return WaitPolicy::LastPoll;
+        }
+
+        void record(WaitPhase phase) {
+            if (WaitPolicy::Polls) counters.record(phase);
+        }
+
+        // Must be called with the mutex held
+        void updateDepth() {
+            if (WaitPolicy::Polls) depth.store(queue.size(), std::memory_order_relaxed);
+        }
+
+        // Must be called with the mutex held
+        size_t take(std::vector<T> &out, size_t max) {
+            size_t n = 0;
+            while (n < max && !queue.empty()) {
+                out.push_back(std::move(queue.front()));
+                queue.pop();
+                n++;
+            }
+            updateDepth();
+            return n;
+        }
+
+
         std::queue<T> queue;
+        std::atomic<size_t> depth;
+        WaitCounters counters;
         pthread_mutex_t mutex;
         pthread_cond_t cond;
         pthread_condattr_t condattr;
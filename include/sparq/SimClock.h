@@ -0,0 +1,182 @@
+#ifndef SPARQ_SIMCLOCK_H
+#define SPARQ_SIMCLOCK_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include "TimeQ.h"
+
+namespace sparq {
+    // A simulated clock for running FSMs much faster than real time, for
+    // regression tests of long timeouts.  Its time only moves when every
+    // FSM on it is idle - all their queues are empty - and then it jumps
+    // straight to the earliest timer deadline among them:
+    //
+    //     defineActiveFSMWithQueue(Widget, MyEventType, sparq::SafeQ<MyEventType>, sparq::BasicTimeQ<sparq::SimClock>) { ... };
+    //
+    //     Widget::initialize();
+    //     Widget::push(Start());
+    //     sparq::SimClock::sleepFor(std::chrono::hours(1000));  // returns in well under a second
+    //
+    // The FSMs still run on their own threads, and events are still handled
+    // in the same order as in real time; only the waiting is skipped.  To
+    // tell idle from busy, the clock counts every event pushed to an FSM on
+    // it until the FSM has handled it, so it needs a queue that does not
+    // drop events.  Threads other than the FSMs can wait for simulated time
+    // with sleepFor and sleepUntil.
+    class SimClock {
+    public:
+        typedef std::chrono::nanoseconds duration;
+        typedef duration::rep rep;
+        typedef duration::period period;
+        typedef std::chrono::time_point<SimClock> time_point;
+        static const bool is_steady = true;
+
+        // Anything that the clock waits for before it moves
+        struct Participant {
+            size_t pending = 0;    // events pushed but not yet handled
+            bool signalled = false;
+        };
+
+        static time_point now() {
+            return time_point(duration(state().now.load(std::memory_order_acquire)));
+        }
+
+        // Moves time forward by hand (it never goes back)
+        static void advance(duration d) {
+            State &s = state();
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.now.fetch_add(d.count(), std::memory_order_release);
+            s.cond.notify_all();
+        }
+
+        // Back to time zero, between tests; nothing may be running on the clock
+        static void reset() {
+            State &s = state();
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.now.store(0, std::memory_order_release);
+        }
+
+        static void sleepUntil(time_point when) {
+            Participant p;
+            join(p);
+            idle(p, when);
+            leave(p);
+        }
+
+        static void sleepFor(duration d) {
+            sleepUntil(now() + d);
+        }
+
+        static void join(Participant &) {
+            State &s = state();
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.running++;
+        }
+
+        // Events left on the queue of a participant that leaves are not waited for
+        static void leave(Participant &p) {
+            State &s = state();
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.inflight -= p.pending;
+            p.pending = 0;
+            s.running--;
+            s.cond.notify_all();
+        }
+
+        // Called before an event goes on the participant's queue
+        static void pushing(Participant &p) {
+            State &s = state();
+            std::lock_guard<std::mutex> guard(s.lock);
+            p.pending++;
+            s.inflight++;
+        }
+
+        // Called after it is on the queue
+        static void pushed(Participant &) {
+            State &s = state();
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.cond.notify_all();
+        }
+
+        static void consumed(Participant &p, size_t n) {
+            if (!n) return;
+            State &s = state();
+            std::lock_guard<std::mutex> guard(s.lock);
+            p.pending -= n;
+            s.inflight -= n;
+        }
+
+        static void signal(Participant &p) {
+            State &s = state();
+            std::lock_guard<std::mutex> guard(s.lock);
+            p.signalled = true;
+            s.cond.notify_all();
+        }
+
+        // Waits until p has events, or time reaches deadline.  The last of the
+        // participants to go idle moves time on to the earliest deadline.
+        static void idle(Participant &p, time_point deadline) {
+            State &s = state();
+            std::unique_lock<std::mutex> guard(s.lock);
+            s.running--;
+            auto mine = s.deadlines.insert(deadline);
+            while (p.pending == 0 && !p.signalled && now() < deadline) {
+                if (s.running == 0 && s.inflight == 0) {
+                    const time_point next = *s.deadlines.begin();
+                    if (next != time_point::max() && next > now()) {
+                        s.now.store(next.time_since_epoch().count(), std::memory_order_release);
+                        s.cond.notify_all();
+                        continue;
+                    }
+                }
+                s.cond.wait(guard);
+            }
+            p.signalled = false;
+            s.deadlines.erase(mine);
+            s.running++;
+        }
+
+    private:
+        struct State {
+            std::mutex lock;
+            std::condition_variable cond;
+            std::atomic<rep> now;
+            unsigned running;    // participants that are not idle
+            size_t inflight;     // events pushed and not yet handled, over all participants
+            std::multiset<time_point> deadlines;  // of the idle participants
+            State() : now(0), running(0), inflight(0) {}
+        };
+
+        static State& state() {
+            static State s;
+            return s;
+        }
+    };
+
+    template <>
+    struct ClockTraits<SimClock> {
+        typedef SimClock::Participant Participant;
+
+        static void join(Participant &p) { SimClock::join(p); }
+        static void leave(Participant &p) { SimClock::leave(p); }
+        static void pushing(Participant &p) { SimClock::pushing(p); }
+        static void pushed(Participant &p) { SimClock::pushed(p); }
+        static void consumed(Participant &p, size_t n) { SimClock::consumed(p, n); }
+        static void signal(Participant &p) { SimClock::signal(p); }
+
+        // Never blocks on the queue itself: with nothing to do the FSM idles on
+        // the clock, which wakes it for an event or for its next timer.
+        template <class Q, class V, class T>
+        static void wait(Participant &p, Q &q, V &batch, size_t, T &timers) {
+            if (q.popAll(batch)) return;
+            SimClock::idle(p, timers.empty() ? SimClock::time_point::max() : timers.next());
+            timers.update();
+        }
+    };
+}
+
+#endif //SPARQ_SIMCLOCK_H
@@ -0,0 +1,190 @@
+#ifndef SPARQ_THREAD_H
+#define SPARQ_THREAD_H
+
+#include <cerrno>
+#include <cstddef>
+#include <exception>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include "InlineFunction.h"
+#include "RealTime.h"
+
+namespace sparq {
+    // How a sparq thread is placed and scheduled: the CPUs it may run on,
+    // its scheduling class and priority, its stack size and its name (as
+    // shown by top -H, perf and gdb).  Every component that owns a thread
+    // takes one (AFSMs through setThreadPolicy, before initialize):
+    //
+    //     sparq::ThreadPolicy rt = sparq::ThreadPolicy().named("motion").onCpus({3}).fifo(80);
+    //     Motion::setThreadPolicy(rt);
+    //     Motion::initialize();
+    //
+    // The default policy is a plain thread, as if from std::thread.  Real
+    // time scheduling needs CAP_SYS_NICE (or an RLIMIT_RTPRIO); without it
+    // the thread is started with the default scheduling instead, and
+    // Thread::realtime() says so.
+    struct ThreadPolicy {
+        enum class Scheduling {
+            Default,     // SCHED_OTHER, inherited from the creating thread
+            Fifo,        // SCHED_FIFO
+            RoundRobin   // SCHED_RR
+        };
+
+        std::vector<unsigned> cpus;  // empty for any CPU
+        Scheduling scheduling = Scheduling::Default;
+        int priority = 0;            // 1 to 99 for Fifo and RoundRobin
+        size_t stackSize = 0;        // 0 for the default
+        std::string name;            // at most 15 characters are kept
+
+        ThreadPolicy& onCpus(std::vector<unsigned> c) {
+            cpus = std::move(c);
+            return *this;
+        }
+
+        ThreadPolicy& fifo(int prio) {
+            scheduling = Scheduling::Fifo;
+            priority = prio;
+            return *this;
+        }
+
+        ThreadPolicy& roundRobin(int prio) {
+            scheduling = Scheduling::RoundRobin;
+            priority = prio;
+            return *this;
+        }
+
+        ThreadPolicy& stack(size_t bytes) {
+            stackSize = bytes;
+            return *this;
+        }
+
+        ThreadPolicy& named(std::string n) {
+            name = std::move(n);
+            return *this;
+        }
+
+        // The policy for worker i of a pool: the same, with the index added to the name
+        ThreadPolicy numbered(size_t i) const {
+            ThreadPolicy p(*this);
+            if (!p.name.empty()) p.name += "/" + std::to_string(i);
+            return p;
+        }
+    };
+
+    // A std::thread that is started according to a ThreadPolicy.  Like a
+    // std::thread it must be joined or detached before it is destroyed.
+    class Thread {
+        struct Start {
+            InlineFunction<void()> body;
+            std::string name;
+        };
+
+    public:
+        Thread() noexcept : handle(), running(false), rt(false) {}
+
+        template <class F>
+        Thread(const ThreadPolicy &policy, F &&f) : handle(), running(false), rt(false) {
+            start(policy, new Start{InlineFunction<void()>(std::forward<F>(f)), policy.name.substr(0, 15)});
+        }
+
+        Thread(Thread &&other) noexcept : handle(other.handle), running(other.running), rt(other.rt) {
+            other.running = false;
+        }
+
+        Thread& operator=(Thread &&other) noexcept {
+            if (running) std::terminate();
+            handle = other.handle;
+            running = other.running;
+            rt = other.rt;
+            other.running = false;
+            return *this;
+        }
+
+        Thread(const Thread &) = delete;
+        Thread& operator=(const Thread &) = delete;
+
+        ~Thread() {
+            if (running) std::terminate();
+        }
+
+        bool joinable() const noexcept {
+            return running;
+        }
+
+        void join() {
+            if (!running) throw std::system_error(EINVAL, std::generic_category(), "Thread::join");
+            pthread_join(handle, nullptr);
+            running = false;
+        }
+
+        void detach() {
+            if (!running) throw std::system_error(EINVAL, std::generic_category(), "Thread::detach");
+            pthread_detach(handle);
+            running = false;
+        }
+
+        pthread_t native_handle() const {
+            return handle;
+        }
+
+        // Whether the thread got the real time scheduling its policy asked for
+        bool realtime() const {
+            return rt;
+        }
+
+    private:
+        static void* trampoline(void *arg) {
+            Start *s = static_cast<Start*>(arg);
+            AllocationTrap::markThread();
+            // Named from the inside, so that the name is there before the body runs
+            if (!s->name.empty()) pthread_setname_np(pthread_self(), s->name.c_str());
+            s->body();
+            delete s;
+            return nullptr;
+        }
+
+        void start(const ThreadPolicy &policy, Start *s) {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            if (policy.stackSize) pthread_attr_setstacksize(&attr, policy.stackSize);
+            if (!policy.cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (unsigned cpu : policy.cpus) CPU_SET(cpu, &set);
+                pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+            }
+            const bool wantRt = policy.scheduling != ThreadPolicy::Scheduling::Default;
+            if (wantRt) {
+                struct sched_param param = {};
+                param.sched_priority = policy.priority;
+                pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+                pthread_attr_setschedpolicy(&attr, policy.scheduling == ThreadPolicy::Scheduling::Fifo ? SCHED_FIFO : SCHED_RR);
+                pthread_attr_setschedparam(&attr, &param);
+            }
+            int err = pthread_create(&handle, &attr, &Thread::trampoline, s);
+            if (err == EPERM && wantRt) {
+                // Not allowed real time scheduling: run with the default instead
+                pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+                err = pthread_create(&handle, &attr, &Thread::trampoline, s);
+            } else {
+                rt = wantRt && err == 0;
+            }
+            pthread_attr_destroy(&attr);
+            if (err) {
+                delete s;
+                throw std::system_error(err, std::generic_category(), "Thread: pthread_create failed");
+            }
+            running = true;
+        }
+
+        pthread_t handle;
+        bool running;
+        bool rt;
+    };
+}
+
+#endif //SPARQ_THREAD_H
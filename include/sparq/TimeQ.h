@@ -7,12 +7,16 @@
 
 #include <functional>
 #include <chrono>
-#include <queue>
+#include <cstdint>
 #include <iostream>
+#include <vector>
+#include "InlineFunction.h"
+#include "RealTime.h"
 
 namespace sparq {
-    // Provides a priority Q for time stamps.
-    using callback_t = std::function<void()>;
+    // Provides a priority Q for time stamps.  Callbacks are stored inline, so arming a
+    // timer does not allocate (see SPARQ_CALLBACK_CAPACITY).
+    using callback_t = InlineFunction<void()>;
     using Clock = std::chrono::steady_clock;
     using timepoint_t = Clock::time_point;
 
@@ -24,80 +28,334 @@ namespace sparq {
 
     typedef uint64_t timerid_t;
 
-    struct TimeStamp {
+    // Never the id of a timer: what add returns when there is no room for
+    // one (with SPARQ_REALTIME, past SPARQ_TIMER_CAPACITY timers)
+    static const timerid_t NoTimer = 0;
+
+    // C is the clock the time stamp is on; see BasicTimeQ
+    template <class C>
+    struct BasicTimeStamp {
+        typedef typename C::time_point time_point;
+        typedef typename C::duration duration;
+
         timerid_t id; // Provided by the TimeQ when the TimeStamp is added
         callback_t callback;
-        timepoint_t when;
+        time_point when;
+        duration slack; // How much later than when the callback may run, to share a wakeup
 
-        bool operator>(const TimeStamp &other) const {
+        bool operator>(const BasicTimeStamp &other) const {
             return this->when > other.when;
         }
-        TimeStamp(timerid_t _id, callback_t _callback, timepoint_t _when) :
-                id(_id), callback(std::move(_callback)), when(_when) {}
+        BasicTimeStamp(timerid_t _id, callback_t _callback, time_point _when, duration _slack = duration::zero()) :
+                id(_id), callback(std::move(_callback)), when(_when), slack(_slack) {}
     };
 
-    inline TimeStamp mkTimeStamp(uint64_t micros, const callback_t &callback) {
-        timepoint_t when = Clock::now() + std::chrono::microseconds(micros);
-        return TimeStamp(0, callback, when);
+    using TimeStamp = BasicTimeStamp<Clock>;
+
+    template <class C>
+    BasicTimeStamp<C> mkTimeStampOn(uint64_t micros, callback_t callback, uint64_t slackMicros = 0) {
+        typename C::time_point when = C::now() + std::chrono::microseconds(micros);
+        return BasicTimeStamp<C>(0, std::move(callback), when, std::chrono::microseconds(slackMicros));
+    }
+
+    inline TimeStamp mkTimeStamp(uint64_t micros, callback_t callback, uint64_t slackMicros = 0) {
+        return mkTimeStampOn<Clock>(micros, std::move(callback), slackMicros);
     }
 
-    inline std::ostream& operator<<(std::ostream& o, const TimeStamp &ts) {
-        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(ts.when - Clock::now()).count();
+    template <class C>
+    std::ostream& operator<<(std::ostream& o, const BasicTimeStamp<C> &ts) {
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(ts.when - C::now()).count();
         o << "TimeStamp {id: " << ts.id << " callback?" << bool(ts.callback) << " when " << micros << "us}";
         return o;
     }
 
-    using baseQ = std::priority_queue<TimeStamp, std::vector<TimeStamp>, std::greater<TimeStamp>>;
+    // What a periodic timer does about ticks that went by while its
+    // thread was busy (a tick is missed once the following one is due too)
+    enum class MissedTicks {
+        CatchUp,   // fire once for every tick, back to back
+        Skip,      // drop the late ticks, and fire again on the next one that is on time
+        Coalesce   // fire once for all the late ticks
+    };
 
+    // Advances a periodic timer that is due at deadline.  The new deadline
+    // is on the grid of the first one, whatever the callback latency, so
+    // the period does not drift.  Returns false if this tick should not
+    // fire.
+    template <class T, class D>
+    bool nextPeriod(T &deadline, D period, MissedTicks policy, T now) {
+        const typename D::rep missed = now > deadline ? (now - deadline) / period : 0;
+        if (policy == MissedTicks::CatchUp) {
+            deadline += period;
+            return true;
+        }
+        deadline += period * (missed + 1);
+        return policy == MissedTicks::Coalesce || missed == 0;
+    }
+
+    // A priority queue of TimeStamps that can also cancel them.  It is a
+    // 4-ary heap of small {when, slot} entries; the TimeStamps themselves
+    // live in a slot table, and each slot knows where its entry is in the
+    // heap.  A timer id names its slot (plus a generation count, so a stale
+    // id can not cancel a timer that reused the slot), so cancel takes the
+    // entry out of the heap right away in O(log n), and frees the callback
+    // and everything it captured there and then.  A 4-ary heap is half as
+    // deep as a binary one, and the four children of a node sit next to each
+    // other in memory, which makes up for the extra compares.
+    //
+    // Periodic timers keep their slot and callback for good, and are just
+    // moved down the heap each time they fire.
+    //
+    // A timer with slack may fire anywhere between when and when + slack.
+    // The heap is ordered by that latest time, and next() is the earliest
+    // of them, so the owner sleeps as long as every timer allows.  update()
+    // fires timers in that order, and stops at the first one whose when is
+    // still ahead, so a timer that is due may wait behind it, though never
+    // past its own when + slack.  Only that window is promised, not the
+    // exact when.  Timers due close together thus share one wakeup (as
+    // hrtimers do in Linux).
+    //
+    // The clock is a parameter, so that a TimeQ can run on a simulated clock
+    // (see SimClock); TimeQ itself is on the steady clock.
+    //
+    // With SPARQ_REALTIME the room for SPARQ_TIMER_CAPACITY timers is made
+    // up front, and that is all there is: add returns NoTimer past it.
+    template <class C>
+    class BasicTimeQ {
+    public:
+        typedef C clock;
+        typedef typename C::time_point time_point;
+        typedef typename C::duration duration;
+        typedef BasicTimeStamp<C> stamp_type;
+
+    private:
+        struct Entry {
+            time_point when;  // the latest the timer may fire, when + slack
+            uint32_t slot;
+        };
+
+        struct Slot {
+            stamp_type ts;
+            duration period;  // zero for a one-shot timer
+            MissedTicks policy;
+            uint32_t pos;  // in the heap, or the next free slot
+            uint32_t generation;
+            Slot() : ts(0, callback_t(), time_point()), period(0), policy(MissedTicks::Coalesce), pos(0), generation(1) {}
+        };
+
+        static const uint32_t Arity = 4;
+        static const uint32_t None = 0xffffffffu;
 
-    class TimeQ : private baseQ{
     public:
         static const uint64_t MilliSeconds = 1000;
         static const uint64_t Seconds = 1000*1000;
-        timerid_t add(const TimeStamp &ts) {
-            TimeStamp t(ts);
-            t.id = this->counter++;
-            this->push(t);
-            return t.id;
+
+        BasicTimeQ() : freeSlot(None) {
+#ifdef SPARQ_REALTIME
+            heap.reserve(SPARQ_TIMER_CAPACITY);
+            slots.reserve(SPARQ_TIMER_CAPACITY);
+#endif
         }
+
+        timerid_t add(stamp_type &&ts) {
+            return insert(std::move(ts));
+        }
+
+        timerid_t add(uint64_t micros, callback_t callback, uint64_t slackMicros = 0) {
+            return insert(mkTimeStampOn<C>(micros, std::move(callback), slackMicros));
+        }
+
+        // Fires every micros, first at micros from now, until cancelled
+        timerid_t addPeriodic(uint64_t micros, callback_t callback, MissedTicks policy = MissedTicks::Coalesce,
+                              uint64_t slackMicros = 0) {
+            const timerid_t id = insert(mkTimeStampOn<C>(micros, std::move(callback), slackMicros));
+            if (id == NoTimer) return id;
+            Slot &s = slots[static_cast<uint32_t>(id & 0xffffffffu) - 1];
+            s.period = std::chrono::microseconds(micros > 0 ? micros : 1);
+            s.policy = policy;
+            return id;
+        }
+
         bool empty() const {
-            return baseQ::empty();
+            return heap.empty();
+        }
+
+        size_t size() const {
+            return heap.size();
         }
-        const TimeStamp& top() const {
-            return baseQ::top();
+
+        const stamp_type& top() const {
+            return slots[heap.front().slot].ts;
         }
+
         void pop() {
-            baseQ::pop();
+            release(heap.front().slot);
+            removeAt(0);
         }
-        timepoint_t next() const {
-            auto micros = std::chrono::duration_cast<std::chrono::microseconds>(baseQ::top().when - Clock::now()).count();
-            //std::cout << "Next timer expires " << micros << " from now\n";
-            return baseQ::top().when;
+
+        time_point next() const {
+            return heap.front().when;
         }
+
         bool cancel(timerid_t id) {
-            //std::cout << "cancel: timers in list: " << this->c.size() << "\n";
-            for (auto &t : this->c) {
-                if (t.id == id) {
-                    t.id = 0;
-                    return true;
-                }
-            }
-            return false;
+            const uint32_t slot = static_cast<uint32_t>(id & 0xffffffffu) - 1;
+            if (slot >= slots.size() || slots[slot].ts.id != id) return false;
+            const uint32_t pos = slots[slot].pos;
+            release(slot);
+            removeAt(pos);
+            return true;
         }
+
         void drain() {
             while (!this->empty()) this->pop();
         }
+
+        // Callbacks run after their timer is off the queue (or rescheduled,
+        // if it is periodic), so they may add and cancel timers.
         void update() {
-            while ((!this->empty()) && (this->next() <= Clock::now())) {
-                if (this->top().id && this->top().callback) {
-//                    std::cout << "Processing callback of timer " << this->top().id << "\n";
-                    this->top().callback();
+            const time_point now = C::now();
+            while (!this->empty() && this->top().when <= now) {
+                const uint32_t slot = heap.front().slot;
+                if (slots[slot].period == duration::zero()) {
+                    callback_t callback(std::move(slots[slot].ts.callback));
+                    this->pop();
+                    if (callback) callback();
+                } else {
+                    firePeriodic(slot, now);
                 }
-                this->pop();
             }
         }
-    protected:
-        timerid_t counter = 1;
+
+    private:
+        timerid_t insert(stamp_type &&ts) {
+            uint32_t slot = freeSlot;
+            if (slot != None) {
+                freeSlot = slots[slot].pos;
+            } else {
+#ifdef SPARQ_REALTIME
+                if (slots.size() == SPARQ_TIMER_CAPACITY) return NoTimer;
+#endif
+                slot = static_cast<uint32_t>(slots.size());
+                slots.push_back(Slot());
+            }
+            Slot &s = slots[slot];
+            s.ts.callback = std::move(ts.callback);
+            s.ts.when = ts.when;
+            s.ts.slack = ts.slack;
+            s.ts.id = (static_cast<uint64_t>(s.generation) << 32) | (slot + 1);
+            Entry e = {ts.when + ts.slack, slot};
+            heap.push_back(e);
+            siftUp(static_cast<uint32_t>(heap.size() - 1));
+            return s.ts.id;
+        }
+
+        // Moves the timer to its next deadline in place, then runs the
+        // callback.  The callback is lent out for the call, in case it
+        // cancels its own timer, and put back if the timer survived.
+        void firePeriodic(uint32_t slot, time_point now) {
+            Slot &s = slots[slot];
+            const timerid_t id = s.ts.id;
+            const bool fire = nextPeriod(s.ts.when, s.period, s.policy, now);
+            heap[s.pos].when = s.ts.when + s.ts.slack;
+            siftDown(s.pos);
+            if (!fire) return;
+            callback_t callback(std::move(s.ts.callback));
+            if (callback) callback();
+            if (slots[slot].ts.id == id) slots[slot].ts.callback = std::move(callback);
+        }
+
+        void release(uint32_t slot) {
+            Slot &s = slots[slot];
+            s.period = duration::zero();
+            s.ts.callback = nullptr;
+            s.ts.id = 0;
+            s.generation++;
+            s.pos = freeSlot;
+            freeSlot = slot;
+        }
+
+        void removeAt(uint32_t pos) {
+            const uint32_t last = static_cast<uint32_t>(heap.size() - 1);
+            if (pos != last) {
+                heap[pos] = heap[last];
+                heap.pop_back();
+                slots[heap[pos].slot].pos = pos;
+                if (pos > 0 && heap[pos].when < heap[(pos - 1) / Arity].when) {
+                    siftUp(pos);
+                } else {
+                    siftDown(pos);
+                }
+            } else {
+                heap.pop_back();
+            }
+        }
+
+        void siftUp(uint32_t pos) {
+            const Entry e = heap[pos];
+            while (pos > 0) {
+                const uint32_t parent = (pos - 1) / Arity;
+                if (!(e.when < heap[parent].when)) break;
+                move(parent, pos);
+                pos = parent;
+            }
+            heap[pos] = e;
+            slots[e.slot].pos = pos;
+        }
+
+        void siftDown(uint32_t pos) {
+            const Entry e = heap[pos];
+            const uint32_t n = static_cast<uint32_t>(heap.size());
+            for (;;) {
+                const uint32_t first = pos * Arity + 1;
+                if (first >= n) break;
+                const uint32_t end = first + Arity < n ? first + Arity : n;
+                uint32_t best = first;
+                for (uint32_t c = first + 1; c < end; c++)
+                    if (heap[c].when < heap[best].when) best = c;
+                if (!(heap[best].when < e.when)) break;
+                move(best, pos);
+                pos = best;
+            }
+            heap[pos] = e;
+            slots[e.slot].pos = pos;
+        }
+
+        void move(uint32_t from, uint32_t to) {
+            heap[to] = heap[from];
+            slots[heap[to].slot].pos = to;
+        }
+
+        std::vector<Entry> heap;
+        std::vector<Slot> slots;
+        uint32_t freeSlot;
+    };
+
+    using TimeQ = BasicTimeQ<Clock>;
+
+    // How an AFSM whose timers run on clock C waits for its next event or
+    // timer.  On a real clock it blocks on its queue until the earliest
+    // timer is due.  SimClock specializes this so that simulated time can
+    // jump ahead instead; the participant hooks are there for it, and cost
+    // nothing here.
+    template <class C>
+    struct ClockTraits {
+        struct Participant {};
+
+        static void join(Participant &) {}
+        static void leave(Participant &) {}
+        static void pushing(Participant &) {}
+        static void pushed(Participant &) {}
+        static void consumed(Participant &, size_t) {}
+        static void signal(Participant &) {}
+
+        template <class Q, class V, class T>
+        static void wait(Participant &, Q &q, V &batch, size_t max, T &timers) {
+            if (timers.empty()) {
+                q.popBatch(batch, max);
+            } else {
+                q.tryPopBatchUntil(batch, max, timers.next());
+                timers.update();
+            }
+        }
     };
 
     inline uint64_t operator "" _sec(unsigned long long t) {return t*1000*1000;}
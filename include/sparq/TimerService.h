@@ -0,0 +1,176 @@
+#ifndef SPARQ_TIMERSERVICE_H
+#define SPARQ_TIMERSERVICE_H
+
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "Singleton.h"
+#include "Thread.h"
+#include "TimeQ.h"
+
+namespace sparq {
+    // One timer thread for the whole process.  All timers live in a single
+    // TimeQ, and the thread sleeps in read() on a timerfd armed for the
+    // earliest deadline, so timer precision is the kernel's hrtimer rather
+    // than a condition variable timeout.  Adding a timer that is due before
+    // all the others just re-arms the timerfd from the calling thread.
+    //
+    // Callbacks run on the service thread with the timer lock held, one
+    // after the other, so they must be quick - pushing an event onto a
+    // queue is the intended use.  They may add and cancel timers.
+    class TimerService : public Singleton<TimerService> {
+        friend class Singleton<TimerService>;
+    public:
+        timerid_t add(TimeStamp &&ts) {
+            std::lock_guard<std::recursive_mutex> guard(lock);
+            const timerid_t id = timers.add(std::move(ts));
+            rearm();
+            return id;
+        }
+
+        timerid_t add(uint64_t micros, callback_t callback, uint64_t slackMicros = 0) {
+            return add(mkTimeStamp(micros, std::move(callback), slackMicros));
+        }
+
+        timerid_t addPeriodic(uint64_t micros, callback_t callback, MissedTicks policy = MissedTicks::Coalesce,
+                              uint64_t slackMicros = 0) {
+            std::lock_guard<std::recursive_mutex> guard(lock);
+            const timerid_t id = timers.addPeriodic(micros, std::move(callback), policy, slackMicros);
+            rearm();
+            return id;
+        }
+
+        // Returns false if the timer already fired (or never existed).  Note that
+        // a timer that fired a moment ago may have an event on its way to the
+        // owner's queue, which cancel can not take back.
+        bool cancel(timerid_t id) {
+            std::lock_guard<std::recursive_mutex> guard(lock);
+            return timers.cancel(id);
+        }
+
+        // Where and how the service thread runs.  Call before the service is
+        // first used, which is when the thread starts.
+        static void setThreadPolicy(const ThreadPolicy &policy) {
+            threadPolicy() = policy;
+        }
+
+        size_t pending() {
+            std::lock_guard<std::recursive_mutex> guard(lock);
+            return timers.size();
+        }
+
+    private:
+        TimerService() : fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)), armed(timepoint_t::max()), quit(false) {
+            if (fd < 0) throw std::runtime_error("TimerService: timerfd_create failed");
+            worker = Thread(threadPolicy(), [this]() { run(); });
+        }
+
+        ~TimerService() {
+            {
+                std::lock_guard<std::recursive_mutex> guard(lock);
+                quit = true;
+                arm(Clock::now());
+            }
+            worker.join();
+            close(fd);
+        }
+
+        static ThreadPolicy& threadPolicy() {
+            static ThreadPolicy policy = ThreadPolicy().named("sparq-timers");
+            return policy;
+        }
+
+        void run() {
+            uint64_t expirations;
+            for (;;) {
+                {
+                    std::lock_guard<std::recursive_mutex> guard(lock);
+                    if (quit) break;
+                    armed = timepoint_t::max();
+                    timers.update();
+                    rearm();
+                }
+                // Wakes on expiry, or when another thread re-arms for an earlier deadline
+                if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EINTR && errno != EAGAIN) break;
+            }
+        }
+
+        // Call with the lock held
+        void rearm() {
+            if (timers.empty()) {
+                if (armed != timepoint_t::max()) arm(timepoint_t::max());
+            } else if (timers.next() != armed) {
+                arm(timers.next());
+            }
+        }
+
+        void arm(timepoint_t when) {
+            struct itimerspec spec = {};
+            if (when != timepoint_t::max()) {
+                const auto secs = std::chrono::time_point_cast<std::chrono::seconds>(when);
+                const auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(when - secs);
+                spec.it_value.tv_sec = static_cast<std::time_t>(secs.time_since_epoch().count());
+                spec.it_value.tv_nsec = static_cast<long>(nsecs.count());
+                // An all zero it_value disarms the timer
+                if (spec.it_value.tv_sec <= 0 && spec.it_value.tv_nsec <= 0) spec.it_value.tv_nsec = 1;
+            }
+            timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+            armed = when;
+        }
+
+        int fd;
+        std::recursive_mutex lock;
+        TimeQ timers;
+        timepoint_t armed;  // what the timerfd is set to, max() when disarmed
+        bool quit;
+        Thread worker;
+    };
+
+    // The Timers of an AFSM that hands its timers to the TimerService:
+    //
+    //     defineActiveFSMWithQueue(Widget, MyEventType, sparq::SafeQ<MyEventType>, sparq::ServiceTimers) { ... };
+    //
+    // addTimer and cancelTimer go to the service, whose thread pushes the
+    // event onto the FSM's queue when the timer expires.  As far as the FSM
+    // is concerned it never has a timer pending, so its thread only ever
+    // wakes up for events.  The queue is pushed from the service thread, so
+    // it must take more than one producer (not an SPSCQ), and a full
+    // BoundedQ that blocks holds up every timer in the process.
+    class ServiceTimers {
+    public:
+        typedef Clock clock;
+
+        timerid_t add(TimeStamp &&ts) {
+            return TimerService::it().add(std::move(ts));
+        }
+
+        timerid_t add(uint64_t micros, callback_t callback, uint64_t slackMicros = 0) {
+            return TimerService::it().add(micros, std::move(callback), slackMicros);
+        }
+
+        timerid_t addPeriodic(uint64_t micros, callback_t callback, MissedTicks policy = MissedTicks::Coalesce,
+                              uint64_t slackMicros = 0) {
+            return TimerService::it().addPeriodic(micros, std::move(callback), policy, slackMicros);
+        }
+
+        bool cancel(timerid_t id) {
+            return TimerService::it().cancel(id);
+        }
+
+        bool empty() const {
+            return true;
+        }
+
+        timepoint_t next() const {
+            return timepoint_t::max();
+        }
+
+        void update() {}
+    };
+}
+
+#endif //SPARQ_TIMERSERVICE_H
@@ -0,0 +1,342 @@
+#ifndef SPARQ_TIMERWHEEL_H
+#define SPARQ_TIMERWHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "TimeQ.h"
+
+namespace sparq {
+    // A hierarchical timing wheel with the TimeQ interface, for FSMs that
+    // keep many timers outstanding and arm and cancel them all the time:
+    //
+    //     defineActiveFSMWithQueue(Widget, MyEventType, sparq::SafeQ<MyEventType>, sparq::TimerWheel<>) { ... };
+    //
+    // Time is counted in ticks of TickMicros.  There are Levels wheels of
+    // 64 slots each; a slot of level 0 is one tick wide, and a slot of
+    // level n is 64 times wider than one of level n-1.  A timer goes into
+    // the finest level whose wheel still reaches its expiry, and is moved
+    // down a level (cascaded) when the wheel above comes round to its slot.
+    // Each slot is an intrusive list of timers kept in a slab, so add and
+    // cancel are O(1), and cancel frees the callback right away.  A bit
+    // mask per level makes finding the next busy slot a count of trailing
+    // zeros, so idle ticks cost nothing.
+    //
+    // Expiries are rounded up to a whole tick: a timer never fires early,
+    // and fires at most one tick late.  next() may return the time of a
+    // cascade rather than of an expiry; update() at that time just fires
+    // nothing.  The wheels reach 2^36 ticks ahead (about two years with
+    // the default 1ms tick); timers beyond that wait on an overflow list
+    // that is sorted out each time the top wheel turns over.
+    //
+    // Periodic timers are rescheduled from their previous deadline, not
+    // from the tick they fired on, so they do not drift by a tick a period.
+    //
+    // A timer with slack expires on the roundest tick within its window,
+    // the one with the most trailing zero bits (like the timer slack of
+    // Linux), so timers with overlapping windows tend to pick the same
+    // tick and fire in one wakeup.
+    //
+    // With SPARQ_REALTIME the slab holds SPARQ_TIMER_CAPACITY timers, made
+    // up front, and add returns NoTimer past that.
+    template <uint64_t TickMicros = 1000>
+    class TimerWheel {
+        static_assert(TickMicros > 0, "TimerWheel tick must be at least one microsecond");
+
+        static const unsigned Levels = 6;
+        static const unsigned SlotBits = 6;
+        static const unsigned Slots = 1u << SlotBits;
+        static const uint32_t None = 0xffffffffu;
+        static const uint32_t Overflow = Levels * Slots;  // timers past the last wheel
+        static const uint32_t Firing = Overflow + 1;      // timers being fired by update()
+        static const uint32_t Free = Firing + 1;
+
+        struct Timer {
+            callback_t callback;
+            uint64_t expiry;  // in ticks
+            timepoint_t deadline;
+            Clock::duration slack;
+            Clock::duration period;  // zero for a one-shot timer
+            MissedTicks policy;
+            uint32_t generation;
+            uint32_t list;    // the slot it is in, Overflow, Firing or Free
+            uint32_t prev;
+            uint32_t next;
+        };
+
+    public:
+        typedef Clock clock;
+
+        static const uint64_t MilliSeconds = 1000;
+        static const uint64_t Seconds = 1000*1000;
+
+        TimerWheel() : origin(Clock::now()), current(0), live(0), freeList(None), masks() {
+            for (uint32_t i = 0; i <= Firing; i++) heads[i] = None;
+#ifdef SPARQ_REALTIME
+            timers.reserve(SPARQ_TIMER_CAPACITY);
+#endif
+        }
+
+        timerid_t add(TimeStamp &&ts) {
+            return insert(std::move(ts.callback), ts.when, ts.slack);
+        }
+
+        timerid_t add(uint64_t micros, callback_t callback, uint64_t slackMicros = 0) {
+            return add(mkTimeStamp(micros, std::move(callback), slackMicros));
+        }
+
+        // Fires every micros, first at micros from now, until cancelled
+        timerid_t addPeriodic(uint64_t micros, callback_t callback, MissedTicks policy = MissedTicks::Coalesce,
+                              uint64_t slackMicros = 0) {
+            const timerid_t id = insert(std::move(callback), Clock::now() + std::chrono::microseconds(micros),
+                                        std::chrono::microseconds(slackMicros));
+            if (id == NoTimer) return id;
+            Timer &t = timers[static_cast<uint32_t>(id & 0xffffffffu) - 1];
+            t.period = std::chrono::microseconds(micros > 0 ? micros : 1);
+            t.policy = policy;
+            return id;
+        }
+
+        bool empty() const {
+            return live == 0;
+        }
+
+        // When update() next has work to do: an expiry, or a cascade
+        timepoint_t next() const {
+            uint64_t tick;
+            unsigned level;
+            if (!nextEvent(&tick, &level)) return timepoint_t::max();
+            return timeOf(tick);
+        }
+
+        bool cancel(timerid_t id) {
+            const uint32_t index = static_cast<uint32_t>(id & 0xffffffffu) - 1;
+            if (index >= timers.size()) return false;
+            Timer &t = timers[index];
+            if (t.list == Free || t.generation != static_cast<uint32_t>(id >> 32)) return false;
+            unlink(index);
+            release(index);
+            return true;
+        }
+
+        void drain() {
+            for (uint32_t i = 0; i < timers.size(); i++) {
+                if (timers[i].list != Free) {
+                    unlink(i);
+                    release(i);
+                }
+            }
+        }
+
+        // Fires every timer that is due.  Callbacks may add and cancel timers.
+        void update() {
+            const timepoint_t now = Clock::now();
+            const uint64_t target = tickOf(now);
+            uint64_t tick;
+            unsigned level;
+            while (live && nextEvent(&tick, &level) && tick <= target) {
+                current = tick;
+                // Empty the slot: timers due now go to the firing list, and the
+                // rest are cascaded down to the finer wheels.
+                uint32_t list = Overflow;
+                if (level < Levels) {
+                    list = level * Slots + slotOf(tick, level);
+                    masks[level] &= ~(1ull << slotOf(tick, level));
+                }
+                uint32_t i = heads[list];
+                heads[list] = None;
+                while (i != None) {
+                    const uint32_t next = timers[i].next;
+                    if (timers[i].expiry <= current) {
+                        pushFront(Firing, i);
+                    } else {
+                        place(i);
+                    }
+                    i = next;
+                }
+                fire(now);
+            }
+            if (current < target) current = target;
+        }
+
+    private:
+        timerid_t insert(callback_t &&callback, timepoint_t when, Clock::duration slack) {
+            const uint32_t index = allocate();
+            if (index == None) return NoTimer;
+            if (!live) current = tickOf(Clock::now());
+            Timer &t = timers[index];
+            t.callback = std::move(callback);
+            t.deadline = when;
+            t.slack = slack;
+            t.expiry = expiryOf(when, slack);
+            if (t.expiry <= current) t.expiry = current + 1;
+            place(index);
+            live++;
+            return (static_cast<uint64_t>(t.generation) << 32) | (index + 1);
+        }
+
+        // Puts a timer in the finest level that reaches its expiry
+        void place(uint32_t index) {
+            const uint64_t expiry = timers[index].expiry;
+            if ((expiry >> (SlotBits * Levels)) != (current >> (SlotBits * Levels))) {
+                pushFront(Overflow, index);
+                return;
+            }
+            unsigned level = 0;
+            while (level + 1 < Levels && (expiry >> (SlotBits * (level + 1))) != (current >> (SlotBits * (level + 1))))
+                level++;
+            const uint32_t s = slotOf(expiry, level);
+            pushFront(level * Slots + s, index);
+            masks[level] |= (1ull << s);
+        }
+
+        // The tick of the next busy slot after current, at the finest level
+        // that has one, or the turn of the top wheel if anything overflowed.
+        bool nextEvent(uint64_t *tick, unsigned *at) const {
+            for (unsigned level = 0; level < Levels; level++) {
+                const uint32_t pos = slotOf(current, level);
+                if (pos == Slots - 1) continue;
+                const uint64_t ahead = masks[level] & (~0ull << (pos + 1));
+                if (!ahead) continue;
+                const unsigned s = static_cast<unsigned>(__builtin_ctzll(ahead));
+                const unsigned shift = SlotBits * (level + 1);
+                tick[0] = ((current >> shift) << shift) | (static_cast<uint64_t>(s) << (SlotBits * level));
+                at[0] = level;
+                return true;
+            }
+            if (heads[Overflow] == None) return false;
+            tick[0] = ((current >> (SlotBits * Levels)) + 1) << (SlotBits * Levels);
+            at[0] = Levels;
+            return true;
+        }
+
+        void fire(timepoint_t now) {
+            while (heads[Firing] != None) {
+                const uint32_t i = heads[Firing];
+                unlink(i);
+                if (timers[i].period == Clock::duration::zero()) {
+                    callback_t callback(std::move(timers[i].callback));
+                    release(i);
+                    if (callback) callback();
+                } else {
+                    firePeriodic(i, now);
+                }
+            }
+        }
+
+        // Reschedules the timer before running the callback, which is lent
+        // out for the call in case it cancels its own timer.  A CatchUp
+        // timer that is still behind goes straight back on the firing list.
+        void firePeriodic(uint32_t i, timepoint_t now) {
+            Timer &t = timers[i];
+            const uint32_t generation = t.generation;
+            const bool fire = nextPeriod(t.deadline, t.period, t.policy, now);
+            t.expiry = expiryOf(t.deadline, t.slack);
+            if (t.expiry <= current) {
+                pushFront(Firing, i);
+            } else {
+                place(i);
+            }
+            if (!fire) return;
+            callback_t callback(std::move(t.callback));
+            if (callback) callback();
+            if (timers[i].generation == generation && timers[i].list != Free)
+                timers[i].callback = std::move(callback);
+        }
+
+        static uint32_t slotOf(uint64_t tick, unsigned level) {
+            return static_cast<uint32_t>((tick >> (SlotBits * level)) & (Slots - 1));
+        }
+
+        uint64_t tickOf(timepoint_t t) const {
+            if (t <= origin) return 0;
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(t - origin).count()) / TickMicros;
+        }
+
+        uint64_t ceilTick(timepoint_t t) const {
+            if (t <= origin) return 0;
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t - origin).count();
+            const uint64_t tickNs = TickMicros * 1000;
+            return (static_cast<uint64_t>(ns) + tickNs - 1) / tickNs;
+        }
+
+        // The tick with the most trailing zeros in [when, when + slack]
+        uint64_t expiryOf(timepoint_t when, Clock::duration slack) const {
+            const uint64_t first = ceilTick(when);
+            const uint64_t last = tickOf(when + slack);
+            if (last <= first) return first;
+            const unsigned bit = 63u - static_cast<unsigned>(__builtin_clzll(first ^ last));
+            return last & ~((1ull << bit) - 1);
+        }
+
+        timepoint_t timeOf(uint64_t tick) const {
+            return origin + std::chrono::microseconds(tick * TickMicros);
+        }
+
+        uint32_t allocate() {
+            if (freeList != None) {
+                const uint32_t i = freeList;
+                freeList = timers[i].next;
+                return i;
+            }
+#ifdef SPARQ_REALTIME
+            if (timers.size() == SPARQ_TIMER_CAPACITY) return None;
+#endif
+            Timer t;
+            t.expiry = 0;
+            t.deadline = timepoint_t();
+            t.slack = Clock::duration::zero();
+            t.period = Clock::duration::zero();
+            t.policy = MissedTicks::Coalesce;
+            t.generation = 1;
+            t.list = Free;
+            t.prev = t.next = None;
+            timers.push_back(std::move(t));
+            return static_cast<uint32_t>(timers.size() - 1);
+        }
+
+        void release(uint32_t i) {
+            Timer &t = timers[i];
+            t.callback = nullptr;
+            t.period = Clock::duration::zero();
+            t.generation++;
+            t.list = Free;
+            t.prev = None;
+            t.next = freeList;
+            freeList = i;
+            live--;
+        }
+
+        void pushFront(uint32_t list, uint32_t i) {
+            Timer &t = timers[i];
+            t.list = list;
+            t.prev = None;
+            t.next = heads[list];
+            if (t.next != None) timers[t.next].prev = i;
+            heads[list] = i;
+        }
+
+        void unlink(uint32_t i) {
+            Timer &t = timers[i];
+            if (t.prev != None) {
+                timers[t.prev].next = t.next;
+            } else {
+                heads[t.list] = t.next;
+                if (t.next == None && t.list < Overflow)
+                    masks[t.list / Slots] &= ~(1ull << (t.list % Slots));
+            }
+            if (t.next != None) timers[t.next].prev = t.prev;
+        }
+
+        timepoint_t origin;
+        uint64_t current;  // the last tick processed
+        uint32_t live;
+        uint32_t freeList;
+        std::vector<Timer> timers;
+        uint32_t heads[Firing + 1];
+        uint64_t masks[Levels];
+    };
+}
+
+#endif //SPARQ_TIMERWHEEL_H
@@ -0,0 +1,421 @@
+#ifndef SPARQ_TOPICREGISTRY_H
+#define SPARQ_TOPICREGISTRY_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+#include "InlineFunction.h"
+#include "PubSub.h"
+#include "Singleton.h"
+
+namespace sparq {
+    typedef uint32_t topicid_t;
+    typedef uint64_t subid_t;
+
+    static const topicid_t NoTopic = 0xffffffffu;
+
+    class TopicRegistry;
+    template <class T> class Topic;
+
+    // The part of a Topic<T> that the registry sees
+    class TopicBase {
+    public:
+        virtual ~TopicBase() {}
+
+        topicid_t id() const {
+            return topicId;
+        }
+
+        const std::string& name() const {
+            return topicName;
+        }
+
+    protected:
+        friend class TopicRegistry;
+
+        explicit TopicBase(const std::string &name) : topicName(name), topicId(NoTopic) {}
+
+        // Called with the registry lock held.  fn points to an
+        // InlineFunction<void(topicid_t, const T&)>.
+        virtual std::type_index type() const = 0;
+        virtual void attach(subid_t sub, const std::shared_ptr<void> &fn) = 0;
+        virtual void detach(subid_t sub) = 0;
+
+        std::string topicName;
+        topicid_t topicId;
+    };
+
+    // The topics of the process, by name.  Each name is interned once to a
+    // small integer id, dense from zero, that it keeps for the life of the
+    // process.  Names are paths, "robot/arm1/state", and a subscription can
+    // be to a pattern in which a * stands for any one segment:
+    //
+    //     sparq::Topic<ArmState> arm1("robot/arm1/state");
+    //     sparq::TopicRegistry::it().subscribe<ArmState>("robot/*/state", [](sparq::topicid_t id, const ArmState &s) { ... });
+    //
+    // The pattern is matched when it is subscribed, against the topics
+    // there are, and again for each topic that is added later; both sides
+    // are kept in tries of path segments, so that only the branches that
+    // can match are visited.  A match adds the callback to the topic's
+    // pattern subscribers, which are kept by subscription id, so publishing
+    // does no string matching at all.  A pattern subscription for messages
+    // of type T only matches topics of type T.
+    //
+    // Once interned, a topic can be reached by id, without going through
+    // its name: topic<T>(id) is an index into a table, and publish<T>(id, msg)
+    // publishes to it.  Names are only used to intern.
+    class TopicRegistry : public Singleton<TopicRegistry> {
+        friend class Singleton<TopicRegistry>;
+        template <class T> friend class Topic;
+
+        struct TopicNode {
+            std::map<std::string, std::unique_ptr<TopicNode>> children;
+            topicid_t id = NoTopic;
+        };
+
+        struct PatternNode {
+            std::map<std::string, std::unique_ptr<PatternNode>> children;  // "*" for the wildcard
+            std::vector<subid_t> subs;
+        };
+
+        struct Entry {
+            std::string name;
+            TopicBase *topic;  // nullptr while there is no Topic object with the name
+        };
+
+        struct Subscription {
+            std::string pattern;
+            std::type_index type;
+            std::shared_ptr<void> fn;
+            std::vector<topicid_t> attached;
+        };
+
+    public:
+        // The id of name, which is interned if it is new
+        topicid_t intern(const std::string &name) {
+            std::lock_guard<std::mutex> guard(lock);
+            return internLocked(name);
+        }
+
+        // The id of name, or NoTopic if it was never interned
+        topicid_t find(const std::string &name) {
+            std::lock_guard<std::mutex> guard(lock);
+            const TopicNode *n = &topicRoot;
+            for (const auto &seg : split(name)) {
+                auto it = n->children.find(seg);
+                if (it == n->children.end()) return NoTopic;
+                n = it->second.get();
+            }
+            return n->id;
+        }
+
+        std::string name(topicid_t id) {
+            std::lock_guard<std::mutex> guard(lock);
+            return id < entries.size() ? entries[id].name : std::string();
+        }
+
+        // The Topic object with the id, or nullptr if there is none just
+        // now or it is not a Topic<T>.  The pointer is good for as long as
+        // the Topic object exists.
+        template <class T>
+        Topic<T>* topic(topicid_t id) {
+            std::lock_guard<std::mutex> guard(lock);
+            return topicLocked<T>(id);
+        }
+
+        // Publishes msg on the Topic<T> with the id; false if there is none.
+        // This holds the registry lock, so the topic can not go away under
+        // it; a publisher that knows its topic outlives it can keep the
+        // pointer from topic<T>() and publish without the lock.
+        template <class T>
+        bool publish(topicid_t id, const T &msg) {
+            std::lock_guard<std::mutex> guard(lock);
+            Topic<T> *t = topicLocked<T>(id);
+            if (t) t->publish(msg);
+            return t != nullptr;
+        }
+
+        template <class T>
+        bool publish(topicid_t id, T &&msg) {
+            std::lock_guard<std::mutex> guard(lock);
+            Topic<typename std::decay<T>::type> *t = topicLocked<typename std::decay<T>::type>(id);
+            if (t) t->publish(std::forward<T>(msg));
+            return t != nullptr;
+        }
+
+        // The names matching pattern that have a Topic object just now
+        std::vector<std::string> topics(const std::string &pattern) {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<topicid_t> ids;
+            matchTopics(topicRoot, split(pattern), 0, ids);
+            std::vector<std::string> names;
+            for (topicid_t id : ids) {
+                if (entries[id].topic) names.push_back(entries[id].name);
+            }
+            return names;
+        }
+
+        // Subscribes fn to every topic of type T whose name matches pattern,
+        // now or later.  fn is called on the thread of each topic's PubSub.
+        template <class T>
+        subid_t subscribe(const std::string &pattern, InlineFunction<void(topicid_t, const T&)> fn) {
+            typedef InlineFunction<void(topicid_t, const T&)> fn_t;
+            std::lock_guard<std::mutex> guard(lock);
+            const subid_t sub = nextSub++;
+            const std::vector<std::string> segs = split(pattern);
+            PatternNode *n = &patternRoot;
+            for (const auto &seg : segs) {
+                std::unique_ptr<PatternNode> &child = n->children[seg];
+                if (!child) child.reset(new PatternNode());
+                n = child.get();
+            }
+            n->subs.push_back(sub);
+            Subscription &s = subscriptions.emplace(sub, Subscription{pattern, std::type_index(typeid(T)),
+                                                                      std::make_shared<fn_t>(std::move(fn)),
+                                                                      std::vector<topicid_t>()}).first->second;
+            std::vector<topicid_t> ids;
+            matchTopics(topicRoot, segs, 0, ids);
+            for (topicid_t id : ids) {
+                attach(sub, s, id);
+            }
+            return sub;
+        }
+
+        void unsubscribe(subid_t sub) {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = subscriptions.find(sub);
+            if (it == subscriptions.end()) return;
+            for (topicid_t id : it->second.attached) {
+                if (entries[id].topic) entries[id].topic->detach(sub);
+            }
+            const std::vector<std::string> segs = split(it->second.pattern);
+            std::vector<PatternNode*> path(1, &patternRoot);
+            for (const auto &seg : segs) {
+                path.push_back(path.back()->children[seg].get());
+            }
+            std::vector<subid_t> &subs = path.back()->subs;
+            for (auto s = subs.begin(); s != subs.end(); ++s) {
+                if (*s == sub) {
+                    subs.erase(s);
+                    break;
+                }
+            }
+            // Prunes the nodes the pattern leaves empty, from the leaf up
+            for (size_t i = segs.size(); i > 0; i--) {
+                const PatternNode *n = path[i];
+                if (!n->subs.empty() || !n->children.empty()) break;
+                path[i - 1]->children.erase(segs[i - 1]);
+            }
+            subscriptions.erase(it);
+        }
+
+    private:
+        TopicRegistry() : nextSub(1) {}
+
+        static std::vector<std::string> split(const std::string &path) {
+            std::vector<std::string> segs;
+            size_t start = 0;
+            while (1) {
+                const size_t slash = path.find('/', start);
+                segs.push_back(path.substr(start, slash == std::string::npos ? std::string::npos : slash - start));
+                if (slash == std::string::npos) return segs;
+                start = slash + 1;
+            }
+        }
+
+        // The rest must be called with the lock held
+        template <class T>
+        Topic<T>* topicLocked(topicid_t id) {
+            if (id >= entries.size()) return nullptr;
+            TopicBase *t = entries[id].topic;
+            if (!t || t->type() != std::type_index(typeid(T))) return nullptr;
+            return static_cast<Topic<T>*>(t);
+        }
+
+        topicid_t internLocked(const std::string &name) {
+            TopicNode *n = &topicRoot;
+            for (const auto &seg : split(name)) {
+                std::unique_ptr<TopicNode> &child = n->children[seg];
+                if (!child) child.reset(new TopicNode());
+                n = child.get();
+            }
+            if (n->id == NoTopic) {
+                n->id = static_cast<topicid_t>(entries.size());
+                entries.push_back(Entry{name, nullptr});
+            }
+            return n->id;
+        }
+
+        // Called by Topic's constructor and destructor
+        topicid_t add(TopicBase *topic) {
+            std::lock_guard<std::mutex> guard(lock);
+            const topicid_t id = internLocked(topic->name());
+            if (entries[id].topic) throw std::invalid_argument("TopicRegistry: topic " + topic->name() + " already exists");
+            entries[id].topic = topic;
+            topic->topicId = id;
+            std::vector<subid_t> subs;
+            matchPatterns(patternRoot, split(topic->name()), 0, subs);
+            for (subid_t sub : subs) {
+                attach(sub, subscriptions.find(sub)->second, id);
+            }
+            return id;
+        }
+
+        void remove(TopicBase *topic) {
+            std::lock_guard<std::mutex> guard(lock);
+            entries[topic->id()].topic = nullptr;
+            for (auto &s : subscriptions) {
+                auto &ids = s.second.attached;
+                for (auto it = ids.begin(); it != ids.end(); ++it) {
+                    if (*it == topic->id()) {
+                        ids.erase(it);
+                        break;
+                    }
+                }
+            }
+        }
+
+        void attach(subid_t sub, Subscription &s, topicid_t id) {
+            TopicBase *topic = entries[id].topic;
+            if (!topic || topic->type() != s.type) return;
+            topic->attach(sub, s.fn);
+            s.attached.push_back(id);
+        }
+
+        // The interned topics whose names match the pattern segments from i on
+        void matchTopics(const TopicNode &n, const std::vector<std::string> &segs, size_t i, std::vector<topicid_t> &out) {
+            if (i == segs.size()) {
+                if (n.id != NoTopic) out.push_back(n.id);
+                return;
+            }
+            if (segs[i] == "*") {
+                for (const auto &c : n.children) matchTopics(*c.second, segs, i + 1, out);
+            } else {
+                auto it = n.children.find(segs[i]);
+                if (it != n.children.end()) matchTopics(*it->second, segs, i + 1, out);
+            }
+        }
+
+        // The subscriptions whose patterns match the topic segments from i on
+        void matchPatterns(const PatternNode &n, const std::vector<std::string> &segs, size_t i, std::vector<subid_t> &out) {
+            if (i == segs.size()) {
+                out.insert(out.end(), n.subs.begin(), n.subs.end());
+                return;
+            }
+            auto it = n.children.find(segs[i]);
+            if (it != n.children.end()) matchPatterns(*it->second, segs, i + 1, out);
+            it = n.children.find("*");
+            if (it != n.children.end() && segs[i] != "*") matchPatterns(*it->second, segs, i + 1, out);
+        }
+
+        std::mutex lock;
+        std::vector<Entry> entries;  // by id
+        TopicNode topicRoot;
+        PatternNode patternRoot;
+        std::map<subid_t, Subscription> subscriptions;
+        subid_t nextSub;
+    };
+
+    // A named PubSub, registered with the TopicRegistry for as long as it
+    // exists.  Publishing and subscribing by name work as on a PubSub;
+    // names beginning with # are reserved.  The registry's pattern
+    // subscriptions are not PubSub subscribers of their own: they are kept
+    // by subscription id in an immutable list, replaced as they come and
+    // go, that a single subscriber calls in turn.
+    template <class T>
+    class Topic : public TopicBase {
+    public:
+        using callback = typename PubSub<T>::callback;
+
+        explicit Topic(const std::string &name, const ThreadPolicy &policy = ThreadPolicy())
+                : TopicBase(name), pubsub(policy) {
+            try {
+                TopicRegistry::it().add(this);
+            } catch (...) {
+                pubsub.stop();
+                throw;
+            }
+        }
+
+        ~Topic() {
+            TopicRegistry::it().remove(this);
+            pubsub.stop();
+        }
+
+        void publish(const T& msg) {
+            pubsub.publish(msg);
+        }
+
+        void publish(T&& msg) {
+            pubsub.publish(std::move(msg));
+        }
+
+        void subscribe(const std::string &name, callback c) {
+            pubsub.subscribe(name, std::move(c));
+        }
+
+        void subscribeQueued(const std::string &name, callback c, size_t capacity = 1024,
+                             const ThreadPolicy &policy = ThreadPolicy()) {
+            pubsub.subscribeQueued(name, std::move(c), capacity, policy);
+        }
+
+        void unsubscribe(const std::string &name) {
+            pubsub.unsubscribe(name);
+        }
+
+    protected:
+        typedef InlineFunction<void(topicid_t, const T&)> pattern_fn;
+        typedef std::vector<std::shared_ptr<pattern_fn>> pattern_list;
+
+        std::type_index type() const override {
+            return std::type_index(typeid(T));
+        }
+
+        void attach(subid_t sub, const std::shared_ptr<void> &fn) override {
+            if (patternSubs.empty()) {
+                pubsub.subscribe(patternSubscriber(), [this](const T &msg) {
+                    // Holds the list, and with it the callbacks, while they are called
+                    const std::shared_ptr<const pattern_list> list = std::atomic_load(&patterns);
+                    for (const auto &f : *list) (*f)(id(), msg);
+                });
+            }
+            patternSubs[sub] = std::static_pointer_cast<pattern_fn>(fn);
+            republishPatterns();
+        }
+
+        void detach(subid_t sub) override {
+            patternSubs.erase(sub);
+            republishPatterns();
+            if (patternSubs.empty()) pubsub.unsubscribe(patternSubscriber());
+        }
+
+    private:
+        // The name of the subscriber that calls the pattern subscriptions
+        static const char* patternSubscriber() {
+            return "#patterns";
+        }
+
+        void republishPatterns() {
+            std::shared_ptr<pattern_list> next = std::make_shared<pattern_list>();
+            next->reserve(patternSubs.size());
+            for (const auto &p : patternSubs) next->push_back(p.second);
+            std::atomic_store(&patterns, std::shared_ptr<const pattern_list>(std::move(next)));
+        }
+
+        // Guarded by the registry lock
+        std::map<subid_t, std::shared_ptr<pattern_fn>> patternSubs;
+        // Read by the PubSub thread; declared before it, so it goes after it
+        std::shared_ptr<const pattern_list> patterns{std::make_shared<pattern_list>()};
+        PubSub<T> pubsub;
+    };
+}
+
+#endif //SPARQ_TOPICREGISTRY_H
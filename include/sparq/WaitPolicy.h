@@ -0,0 +1,101 @@
+#ifndef SPARQ_WAITPOLICY_H
+#define SPARQ_WAITPOLICY_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+namespace sparq {
+    // Tell the CPU we are in a spin loop (lets the sibling hyperthread run
+    // and avoids the memory order mis-speculation penalty on loop exit).
+    inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+    }
+
+    // The phase of a wait in which the consumer found something to pop
+    enum class WaitPhase {Immediate, Spin, Yield, Park};
+
+    struct WaitStats {
+        uint64_t immediate;  // data was already there
+        uint64_t spun;       // data arrived while spinning
+        uint64_t yielded;    // data arrived while yielding
+        uint64_t parked;     // had to block in the kernel
+    };
+
+    // How a consumer waits on an empty queue.  It first polls the queue
+    // Spins times with a pause instruction in between, then Yields times
+    // giving up its time slice, and only then parks on the condition
+    // variable.  Spinning trades CPU for latency: an event that arrives
+    // while the consumer is still spinning is picked up without a futex
+    // wake or a context switch.
+    //
+    // wait() returns the phase that saw data, or Park if none did.
+    template <unsigned Spins, unsigned Yields>
+    struct SpinThenPark {
+        static const bool Polls = (Spins + Yields) > 0;
+        // The phase that polls last: data that turns up just after it gives
+        // up, but before the consumer blocks, is counted under it
+        static constexpr WaitPhase LastPoll = Yields > 0 ? WaitPhase::Yield : Spins > 0 ? WaitPhase::Spin : WaitPhase::Immediate;
+
+        template <class Pred>
+        static WaitPhase wait(Pred ready) {
+            if (!Polls) return WaitPhase::Park;
+            if (ready()) return WaitPhase::Immediate;
+            for (unsigned i = 0; i < Spins; i++) {
+                cpuRelax();
+                if (ready()) return WaitPhase::Spin;
+            }
+            for (unsigned i = 0; i < Yields; i++) {
+                std::this_thread::yield();
+                if (ready()) return WaitPhase::Yield;
+            }
+            return WaitPhase::Park;
+        }
+    };
+
+    // Go straight to the kernel (the original SafeQ behaviour)
+    using BlockingWait = SpinThenPark<0, 0>;
+
+    template <unsigned Spins>
+    using SpinWait = SpinThenPark<Spins, 0>;
+
+    template <unsigned Yields>
+    using YieldWait = SpinThenPark<0, Yields>;
+
+    // Per queue counters of which phase ended each wait.  They are only
+    // written by consumers, and can be read from any thread.
+    class WaitCounters {
+    public:
+        WaitCounters() : immediate(0), spun(0), yielded(0), parked(0) {}
+
+        void record(WaitPhase phase) {
+            switch (phase) {
+                case WaitPhase::Immediate: immediate.fetch_add(1, std::memory_order_relaxed); break;
+                case WaitPhase::Spin: spun.fetch_add(1, std::memory_order_relaxed); break;
+                case WaitPhase::Yield: yielded.fetch_add(1, std::memory_order_relaxed); break;
+                case WaitPhase::Park: parked.fetch_add(1, std::memory_order_relaxed); break;
+            }
+        }
+
+        WaitStats snapshot() const {
+            WaitStats s;
+            s.immediate = immediate.load(std::memory_order_relaxed);
+            s.spun = spun.load(std::memory_order_relaxed);
+            s.yielded = yielded.load(std::memory_order_relaxed);
+            s.parked = parked.load(std::memory_order_relaxed);
+            return s;
+        }
+
+    private:
+        std::atomic<uint64_t> immediate;
+        std::atomic<uint64_t> spun;
+        std::atomic<uint64_t> yielded;
+        std::atomic<uint64_t> parked;
+    };
+}
+
+#endif //SPARQ_WAITPOLICY_H
@@ -3,17 +3,35 @@
 
 #include <chrono>
 #include <mutex>
-#include <thread>
-#include "SafeQ.h"
+#include <utility>
+#include <vector>
+#include "DefaultQ.h"
+#include "Thread.h"
 
 namespace sparq {
     // A work queue is a thread that reads messages from an input queue
-    // and processes them.
-    template <class MsgType>
+    // and processes them.  The input queue can be any type with the SafeQ
+    // interface, and defaults to DefaultQ.
+    //
+    // Messages are taken off the queue in batches of up to batchSize, and
+    // handed to processBatch(), which by default calls process() on each.
+    // Sinks whose cost is per call rather than per message (a write(), a
+    // flush, a database transaction) can override processBatch() to handle
+    // the whole batch at once.  With a linger time, a batch that is not yet
+    // full waits up to that long for more messages before it is processed,
+    // trading a little latency for bigger batches.  Queues that check
+    // deadlines as messages are popped (DeadlineQ) are never lingered on,
+    // as a message could then miss its deadline after passing the check.
+    template <class MsgType, class Queue = DefaultQ<MsgType>>
     class WorkQueue {
     public:
-        WorkQueue() : msgQ() {
-            t1 = new std::thread(&WorkQueue::run, this);
+        explicit WorkQueue(size_t batchSize = BatchSize, std::chrono::microseconds lingerTime = std::chrono::microseconds(0))
+                : WorkQueue(ThreadPolicy(), batchSize, lingerTime) {}
+
+        explicit WorkQueue(const ThreadPolicy &policy, size_t batchSize = BatchSize,
+                           std::chrono::microseconds lingerTime = std::chrono::microseconds(0))
+                : msgQ(), maxBatch(batchSize > 0 ? batchSize : 1), linger(lingerTime) {
+            t1 = new Thread(policy, [this]() { run(); });
         }
 
         ~WorkQueue() {
@@ -26,6 +44,30 @@ namespace sparq {
             this->msgQ.push(msg);
         }
 
+        void push(MsgType && msg) {
+            this->msgQ.push(std::move(msg));
+        }
+
+        // Push with a deadline.  Needs a queue that orders by deadline
+        // (DeadlineQ), which then has the earliest deadline processed first.
+        void push(const MsgType & msg, std::chrono::steady_clock::time_point deadline) {
+            this->msgQ.push(msg, deadline);
+        }
+
+        void push(MsgType && msg, std::chrono::steady_clock::time_point deadline) {
+            this->msgQ.push(std::move(msg), deadline);
+        }
+
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            this->msgQ.emplace(std::forward<Args>(args)...);
+        }
+
+        // For reading queue statistics (e.g. InstrumentedQ::stats) from other threads
+        const Queue& queue() const {
+            return msgQ;
+        }
+
         void shutdown() {
             guard.lock();
             quit = true;
@@ -36,33 +78,63 @@ namespace sparq {
         }
 
     protected:
-        sparq::SafeQ<MsgType> msgQ;
-        std::thread *t1;
+        // The default batch size
+        static const size_t BatchSize = 64;
+
+        Queue msgQ;
+        Thread *t1;
 
         virtual void initialize() {}
         virtual void process(const MsgType &t) = 0;
 
+        // n is at least one, and msgs are in the order they were popped
+        virtual void processBatch(const MsgType *msgs, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                process(msgs[i]);
+            }
+        }
+
         void run() {
             initialize();
+            std::vector<MsgType> batch;
+            batch.reserve(maxBatch);
             while (1) {
-                MsgType msg{};
-                bool didPop = false;
+                batch.clear();
                 // If we are shutting down, then add a timeout so that we can
                 // stop on the first timeout (i.e. when the input queue is empty).
                 if (doQuit()) {
                     const auto when = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
-                    didPop = msgQ.tryPopUntil(&msg, when);
+                    msgQ.tryPopBatchUntil(batch, maxBatch, when);
                 } else {
-                    didPop = msgQ.tryPop(&msg);
+                    msgQ.tryPopBatch(batch, maxBatch);
+                }
+                if (doQuit() && batch.empty()) { return; }
+                if (!batch.empty() && linger.count() > 0 && !deadlineOrdered<Queue>(nullptr)) {
+                    const auto until = std::chrono::steady_clock::now() + linger;
+                    while (batch.size() < maxBatch && std::chrono::steady_clock::now() < until) {
+                        msgQ.tryPopBatchUntil(batch, maxBatch - batch.size(), until);
+                    }
+                }
+                if (!batch.empty()) {
+                    processBatch(batch.data(), batch.size());
                 }
-                if (doQuit() && !didPop) { return; }
-                if (didPop) {
-                    process(msg);
-                } 
             }
         }
 
     private:
+        // Whether the queue says it is DeadlineOrdered
+        template <class Q>
+        static constexpr bool deadlineOrdered(decltype(&Q::DeadlineOrdered)) {
+            return Q::DeadlineOrdered;
+        }
+
+        template <class Q>
+        static constexpr bool deadlineOrdered(...) {
+            return false;
+        }
+
+        const size_t maxBatch;
+        const std::chrono::microseconds linger;
         std::mutex guard;
         bool quit{false};
         bool doQuit() {
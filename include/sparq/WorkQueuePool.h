@@ -0,0 +1,173 @@
+#ifndef SPARQ_WORKQUEUEPOOL_H
+#define SPARQ_WORKQUEUEPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Parker.h"
+#include "Thread.h"
+
+namespace sparq {
+    // A WorkQueue with several worker threads, for messages that can be
+    // processed independently of each other.  It has the same contract:
+    // subclasses implement process() (and optionally initialize(), which
+    // each worker calls once, on its own thread, before its first message),
+    // producers push(), and shutdown() processes everything already pushed
+    // and then joins the workers.  process() runs on many threads at once,
+    // and messages are not processed in the order they were pushed.
+    //
+    // Each worker has its own deque.  Pushes are dealt out to the workers
+    // round robin, and a worker that runs out of work steals half of the
+    // deque of the first busy worker it finds, so the load evens out
+    // without the workers contending on a single queue.  Idle workers park
+    // until there is work.
+    template <class MsgType>
+    class WorkQueuePool {
+        struct Worker {
+            std::mutex lock;
+            std::deque<MsgType> q;
+            Thread thread;
+            char pad[CacheLine];
+        };
+
+    public:
+        // The workers are started with the policy, numbered
+        explicit WorkQueuePool(size_t workers = std::thread::hardware_concurrency(), const ThreadPolicy &policy = ThreadPolicy())
+                : count(workers > 0 ? workers : 1), pool(new Worker[count]), next(0), pending(0), quit(false) {
+            for (size_t i = 0; i < count; i++)
+                pool[i].thread = Thread(policy.numbered(i), [this, i]() { run(i); });
+        }
+
+        virtual ~WorkQueuePool() {
+            if (pool[0].thread.joinable()) {
+                shutdown();
+            }
+        }
+
+        void push(const MsgType &msg) {
+            Worker &w = target();
+            {
+                std::lock_guard<std::mutex> guard(w.lock);
+                w.q.push_back(msg);
+            }
+            parker.notify();
+        }
+
+        void push(MsgType &&msg) {
+            Worker &w = target();
+            {
+                std::lock_guard<std::mutex> guard(w.lock);
+                w.q.push_back(std::move(msg));
+            }
+            parker.notify();
+        }
+
+        template <class ... Args>
+        void emplace(Args&& ... args) {
+            Worker &w = target();
+            {
+                std::lock_guard<std::mutex> guard(w.lock);
+                w.q.emplace_back(std::forward<Args>(args)...);
+            }
+            parker.notify();
+        }
+
+        // Waits for all the pushed messages to be processed, then stops the workers
+        void shutdown() {
+            quit.store(true, std::memory_order_relaxed);
+            parker.notifyAll();
+            for (size_t i = 0; i < count; i++) {
+                if (pool[i].thread.joinable()) pool[i].thread.join();
+            }
+        }
+
+        size_t workers() const {
+            return count;
+        }
+
+        // Messages pushed and not yet taken by a worker
+        size_t depth() const {
+            return pending.load(std::memory_order_relaxed);
+        }
+
+    protected:
+        // A worker takes up to this many messages at a time from its own deque
+        static const size_t BatchSize = 64;
+
+        virtual void initialize() {}
+        virtual void process(const MsgType &t) = 0;
+
+    private:
+        // Counts the message before it is visible, so that pending never
+        // under-counts what is in the deques.
+        Worker& target() {
+            pending.fetch_add(1, std::memory_order_relaxed);
+            return pool[next.fetch_add(1, std::memory_order_relaxed) % count];
+        }
+
+        void run(size_t me) {
+            // Nothing runs until there is work, by which time the subclass is fully constructed
+            parker.park([this]() { return hasWork(); });
+            initialize();
+            std::vector<MsgType> batch;
+            batch.reserve(BatchSize);
+            while (1) {
+                batch.clear();
+                if (!takeOwn(me, batch) && !steal(me, batch)) {
+                    if (quit.load(std::memory_order_relaxed) && pending.load(std::memory_order_acquire) == 0) return;
+                    parker.park([this]() { return hasWork(); });
+                    continue;
+                }
+                pending.fetch_sub(batch.size(), std::memory_order_relaxed);
+                for (const auto &msg : batch) {
+                    process(msg);
+                }
+            }
+        }
+
+        bool hasWork() const {
+            return pending.load(std::memory_order_relaxed) > 0 || quit.load(std::memory_order_relaxed);
+        }
+
+        bool takeOwn(size_t me, std::vector<MsgType> &batch) {
+            Worker &w = pool[me];
+            std::lock_guard<std::mutex> guard(w.lock);
+            while (!w.q.empty() && batch.size() < BatchSize) {
+                batch.push_back(std::move(w.q.front()));
+                w.q.pop_front();
+            }
+            return !batch.empty();
+        }
+
+        // Takes the back half of the first other deque that has anything in it
+        bool steal(size_t me, std::vector<MsgType> &batch) {
+            for (size_t k = 1; k < count; k++) {
+                Worker &victim = pool[(me + k) % count];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                size_t n = (victim.q.size() + 1) / 2;
+                if (n == 0) continue;
+                if (n > BatchSize) n = BatchSize;
+                for (auto it = victim.q.end() - n; it != victim.q.end(); ++it) batch.push_back(std::move(*it));
+                victim.q.erase(victim.q.end() - n, victim.q.end());
+                return true;
+            }
+            return false;
+        }
+
+        const size_t count;
+        std::unique_ptr<Worker[]> pool;
+        std::atomic<size_t> next;
+        char pad0[CacheLine - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> pending;
+        char pad1[CacheLine - sizeof(std::atomic<size_t>)];
+        std::atomic<bool> quit;
+        Parker parker;
+    };
+}
+
+#endif //SPARQ_WORKQUEUEPOOL_H